@@ -1,18 +1,90 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 struct image
 {
     int height;
     int width;
     unsigned char **raster;
+    void *map; /* mapped file holding the pixels, NULL if the raster is allocated */
+    size_t map_length;
 };
 
+/*
+ * The pixels live in a shared anonymous mapping : after a fork, the workers
+ * write their band of the output in place and the parent sees it directly.
+ *
+ * Large rasters are mapped on huge page boundaries and advised to use
+ * transparent huge pages, or explicit ones with --hugetlb (when the system has
+ * reserved some). The kernel zero-fills their pages when they are first
+ * touched, so nothing writes them before the pixels themselves; with
+ * --first-touch, each worker reads its own band of the input, which places
+ * those pages on its NUMA node.
+ */
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+int raster_hugetlb = 0;
+
+/* Length actually mapped for a raster of length bytes */
+static size_t raster_map_length(size_t length)
+{
+    if (length < HUGE_PAGE_SIZE)
+        return length;
+    return (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+static void *raster_map(size_t length)
+{
+    length = raster_map_length(length);
+    if (length < HUGE_PAGE_SIZE)
+    {
+        void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        return map == MAP_FAILED ? NULL : map;
+    }
+
+    if (raster_hugetlb)
+    {
+        void *map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED)
+            return map;
+    }
+
+    /* One more huge page than needed, the unaligned ends are unmapped */
+    size_t padded = length + HUGE_PAGE_SIZE;
+    char *map = (char *)mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((size_t)map + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > map)
+        munmap(map, aligned - map);
+    munmap(aligned + length, map + padded - (aligned + length));
+    madvise(aligned, length, MADV_HUGEPAGE);
+    return aligned;
+}
+
 unsigned char **
 raster_alloc(int height, int width)
 {
@@ -20,27 +92,37 @@ raster_alloc(int height, int width)
     if (raster == NULL)
         return NULL;
 
-    raster[0] = (unsigned char *)calloc(height * width, sizeof(unsigned char));
-    if (raster[0] == NULL)
+    void *pixels = raster_map((size_t)height * width);
+    if (pixels == NULL)
+    {
+        free(raster);
         return NULL;
+    }
 
+    raster[0] = (unsigned char *)pixels;
     for (int i = 1; i < height; ++i)
-        raster[i] = raster[0] + i * width;
+        raster[i] = raster[0] + (size_t)i * width;
 
     return raster;
 }
 
-void raster_free(unsigned char **raster)
+void raster_free(unsigned char **raster, int height, int width)
 {
     if (raster == NULL)
         return;
-    free(raster[0]);
+    munmap(raster[0], raster_map_length((size_t)height * width));
     free(raster);
 }
 
 void image_free(struct image *self)
 {
-    raster_free(self->raster);
+    if (self->map != NULL)
+    {
+        munmap(self->map, self->map_length);
+        free(self->raster);
+    }
+    else
+        raster_free(self->raster, self->height, self->width);
     free(self);
 }
 
@@ -57,7 +139,10 @@ image_alloc(int height, int width)
     self->raster = raster_alloc(height, width);
 
     if (self->raster == NULL)
+    {
         image_free(self);
+        return NULL;
+    }
 
     return self;
 }
@@ -134,12 +219,321 @@ void pgm_write_header(struct image *img, FILE *fp)
 
 void pgm_write_raster(struct image *img, FILE *fp)
 {
-    fwrite(img->raster[0], sizeof(unsigned char), img->height * img->width, fp);
+    fwrite(img->raster[0], sizeof(unsigned char), (size_t)img->height * img->width, fp);
 }
 
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 
+/*
+ * Memory-mapped images
+ *
+ * pgm_map() maps the input file and points the raster straight into the
+ * mapping, after the header : no buffer is allocated and nothing is copied.
+ * pgm_create() sizes the output file with ftruncate() and maps it shared, so
+ * the filters write their pixels directly into the page cache. In both cases
+ * image_free() unmaps the file.
+ */
+
+/* Parse "P5 width height maxval" followed by a single whitespace; returns the raster offset */
+static long pgm_parse_header_mapped(const unsigned char *data, size_t length, int *width, int *height)
+{
+    if (length < 2 || data[0] != 'P' || data[1] != '5')
+    {
+        fprintf(stderr, "Parsing failed : magic number 5 expected\n");
+        return -1;
+    }
+
+    const char *names[] = {"width", "height", "maximum gray value"};
+    int values[3];
+    size_t pos = 2;
+    for (int i = 0; i < 3; ++i)
+    {
+        while (pos < length && isspace(data[pos]))
+            ++pos;
+        if (pos == length || !isdigit(data[pos]))
+        {
+            fprintf(stderr, "Parsing failed : %s expected\n", names[i]);
+            return -1;
+        }
+
+        long value = 0;
+        while (pos < length && isdigit(data[pos]) && value <= INT_MAX)
+            value = value * 10 + (data[pos++] - '0');
+        if (value > INT_MAX)
+        {
+            fprintf(stderr, "Parsing failed : %s out of range\n", names[i]);
+            return -1;
+        }
+        values[i] = (int)value;
+    }
+
+    if (pos == length || !isspace(data[pos]))
+    {
+        fprintf(stderr, "Parsing failed : whitespace expected after the header\n");
+        return -1;
+    }
+
+    if (values[2] > 255)
+    {
+        fprintf(stderr,
+                "Parsing failed : maximum gray value < 255 is expected, "
+                "got %d instead\n",
+                values[2]);
+        return -1;
+    }
+
+    *width = values[0];
+    *height = values[1];
+    return pos + 1;
+}
+
+static struct image *
+image_map(void *map, size_t map_length, long offset, int height, int width)
+{
+    struct image *self = (struct image *)calloc(1, sizeof(struct image));
+    if (self == NULL)
+        return NULL;
+
+    self->height = height;
+    self->width = width;
+    self->map = map;
+    self->map_length = map_length;
+
+    self->raster = (unsigned char **)calloc(MAX(height, 1), sizeof(unsigned char *));
+    if (self->raster == NULL)
+    {
+        image_free(self);
+        return NULL;
+    }
+
+    for (int i = 0; i < height; ++i)
+        self->raster[i] = (unsigned char *)map + offset + (size_t)i * width;
+
+    return self;
+}
+
+/*
+ * Returns NULL if filename cannot be mapped (a pipe for instance), with errno
+ * set to EINVAL if it is not a valid PGM file.
+ */
+struct image *
+pgm_map(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    int width, height;
+    long offset = pgm_parse_header_mapped((const unsigned char *)map, st.st_size, &width, &height);
+    if (offset >= 0 && (size_t)st.st_size - offset < (size_t)height * width)
+    {
+        fprintf(stderr, "Parsing failed : the raster is truncated\n");
+        offset = -1;
+    }
+    if (offset < 0)
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct image *img = image_map(map, st.st_size, offset, height, width);
+    if (img == NULL)
+        munmap(map, st.st_size);
+    return img;
+}
+
+/* Returns NULL if filename cannot be sized and mapped (a pipe or a terminal for instance) */
+struct image *
+pgm_create(const char *filename, int height, int width)
+{
+    char header[64];
+    int offset = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", width, height);
+    size_t length = offset + (size_t)height * width;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return NULL;
+
+    if (ftruncate(fd, length) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    memcpy(map, header, offset);
+
+    struct image *img = image_map(map, length, offset, height, width);
+    if (img == NULL)
+        munmap(map, length);
+    return img;
+}
+
+/* 1 if both paths name the same existing file */
+int same_file(const char *a, const char *b)
+{
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/*
+ * First-touch input
+ *
+ * pgm_open_bands() parses the header and allocates the raster without reading
+ * it : each worker then calls band_load() on its own rows before convolving
+ * them, so the pages of a band are first touched, and placed on a NUMA node,
+ * by the worker that uses them. On a machine with several nodes, worker i is
+ * pinned to the CPUs of node i * nnodes / nworkers for both steps.
+ */
+
+struct band_source
+{
+    int fd;
+    off_t offset; /* of the raster in the file */
+};
+
+/*
+ * Returns NULL if filename cannot be read this way (a pipe for instance), with
+ * errno set to EINVAL if it is not a valid PGM file. The caller closes source->fd.
+ */
+struct image *
+pgm_open_bands(const char *filename, struct band_source *source)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    unsigned char header[4096];
+    ssize_t length = 0;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        (length = pread(fd, header, sizeof(header), 0)) <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    int width, height;
+    long offset = pgm_parse_header_mapped(header, length, &width, &height);
+    if (offset >= 0 && (size_t)st.st_size - offset < (size_t)height * width)
+    {
+        fprintf(stderr, "Parsing failed : the raster is truncated\n");
+        offset = -1;
+    }
+    if (offset < 0)
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct image *img = image_alloc(height, width);
+    if (img == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    source->fd = fd;
+    source->offset = offset;
+    return img;
+}
+
+/* Reads the rows [row_begin, row_end) of img from source; returns 0 on success */
+int band_load(struct image *img, const struct band_source *source, int row_begin, int row_end)
+{
+    size_t begin = (size_t)row_begin * img->width;
+    size_t length = (size_t)row_end * img->width - begin;
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = pread(source->fd, img->raster[0] + begin + done, length - done,
+                          source->offset + begin + done);
+        if (n <= 0)
+        {
+            fprintf(stderr, "Unable to read rows %d to %d of the input\n", row_begin, row_end);
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* Number of NUMA nodes, 1 when the system does not tell */
+static int numa_node_count(void)
+{
+    char path[64];
+    int nnodes = 0;
+    for (;; ++nnodes)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", nnodes);
+        if (access(path, F_OK) != 0)
+            break;
+    }
+    return MAX(nnodes, 1);
+}
+
+/* Reads the CPU list of node ("0-7,16-23"); returns 0 on success */
+static int numa_node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+
+    CPU_ZERO(cpus);
+    int first, last;
+    while (fscanf(fp, "%d", &first) == 1)
+    {
+        last = first;
+        int c = fgetc(fp);
+        if (c == '-')
+        {
+            if (fscanf(fp, "%d", &last) != 1)
+                break;
+            c = fgetc(fp);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, cpus);
+        if (c != ',')
+            break;
+    }
+    fclose(fp);
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+/* Pins the calling process or thread to the NUMA node of worker, if there are several */
+void worker_pin(int worker, int nworkers)
+{
+    int nnodes = numa_node_count();
+    if (nnodes < 2)
+        return;
+
+    cpu_set_t cpus;
+    if (numa_node_cpus((int)((long)worker * nnodes / nworkers), &cpus) == 0)
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
 int sum_over_kernel(struct image *img, int row, int col, double kernel[3][3])
 {
     double sum = 0;
@@ -181,93 +575,1010 @@ void convolve(struct image *img, kernel_t *kernels[2], struct image *out)
     }
 }
 
-int main(int argc, char *argv[])
+/*
+ * Tiled convolution engine
+ *
+ * convolve() checks the image bounds for every tap of every pixel. Here, the
+ * output is produced tile by tile : a tile is a block of rows whose source rows
+ * fit in the cache, restricted to a range of columns. Pixels that are at least
+ * one pixel away from the image border are computed without any bounds check;
+ * only the one pixel wide border strips go through sum_over_kernel().
+ *
+ * The taps are accumulated in the same order as sum_over_kernel() so that the
+ * output is byte-identical to the one of convolve().
+ */
+
+#define TILE_CACHE_SIZE (256 * 1024)
+#define TILE_WIDTH 4096
+
+static unsigned char clamp_pixel(double val)
 {
-    FILE *fp = fopen(argv[1], "r");
+    val = MIN(val, 255);
+    val = MAX(val, 0);
+    return (unsigned char)val;
+}
 
-    struct image *img = pgm_parse(fp);
-    fclose(fp);
+static void convolve_border_pixel(struct image *img, kernel_t *kernels[2], struct image *out,
+                                  int row, int col)
+{
+    double val = sum_over_kernel(img, row, col, *kernels[0]);
+    if (kernels[1] != NULL)
+    {
+        double valy = sum_over_kernel(img, row, col, *kernels[1]);
+        val = sqrt(val * val + valy * valy);
+    }
+    out->raster[row][col] = clamp_pixel(val);
+}
+
+/*
+ * The vectorized rows are the ones of image_processing.c : 8-bit images use
+ * its 16-bit integer lanes for the exact fixed-point kernels and its double
+ * precision lanes for the others.
+ */
+#include "../../projet/2018/multi_processes/convolve_simd.h"
+
+/*
+ * Built-in filters
+ *
+ * The built-in kernels are listed once in BUILTIN_KERNELS, as integer weights
+ * over a divisor. Their kernel_t are generated from the list, and so is a row
+ * function per kernel whose weights are compile-time constants : the nine
+ * taps are unrolled, the zero weights disappear and the symmetric weights are
+ * plain constants the compiler can share or vectorize. Kernels with a power of
+ * two divisor are summed exactly in integers, the others (box_blur) in double
+ * precision in the order of sum_over_kernel(), so each row function gives the
+ * output of convolve(). builtin_filters maps the names to the instances.
+ */
+
+/* X(name, divisor, the 9 weights row by row) */
+#define BUILTIN_KERNELS(X)                                    \
+    X(identity, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0)                 \
+    X(box_blur, 9, 1, 1, 1, 1, 1, 1, 1, 1, 1)                 \
+    X(gaussian_blur, 16, 1, 2, 1, 2, 4, 2, 1, 2, 1)           \
+    X(sharpen, 1, 0, -1, 0, -1, 5, -1, 0, -1, 0)              \
+    X(edge_detect, 1, 0, 1, 0, 1, -4, 1, 0, 1, 0)             \
+    X(edge_detect2, 1, -1, -1, -1, -1, 8, -1, -1, -1, -1)     \
+    X(edge_detect_x, 1, -1, 0, 1, -2, 0, 2, -1, 0, 1)         \
+    X(edge_detect_y, 1, 1, 2, 1, 0, 0, 0, -1, -2, -1)
 
-    double edge_detect[3][3] = {{0, 1, 0},
-                                {1, -4, 1},
-                                {0, 1, 0}};
+#define BUILTIN_KERNEL_T(NAME, D, W00, W01, W02, W10, W11, W12, W20, W21, W22) \
+    kernel_t NAME = {{(double)W00 / D, (double)W01 / D, (double)W02 / D},     \
+                     {(double)W10 / D, (double)W11 / D, (double)W12 / D},     \
+                     {(double)W20 / D, (double)W21 / D, (double)W22 / D}};
 
-    double edge_detect2[3][3] = {{-1, -1, -1},
-                                 {-1, 8, -1},
-                                 {-1, -1, -1}};
+BUILTIN_KERNELS(BUILTIN_KERNEL_T)
 
-    double edge_detect_x[3][3] = {{-1, 0, 1},
-                                  {-2, 0, 2},
-                                  {-1, 0, 1}};
+/* One tap : nothing is generated for a zero weight */
+#define BUILTIN_TAP(SUM, W, P) \
+    if ((W) != 0)              \
+    SUM += (W) * (P)
 
-    double edge_detect_y[3][3] = {{1, 2, 1},
-                                  {0, 0, 0},
-                                  {-1, -2, -1}};
+#define BUILTIN_TAPS(SUM, D, W00, W01, W02, W10, W11, W12, W20, W21, W22, CAST) \
+    BUILTIN_TAP(SUM, CAST W00 / D, r0[j]);                                     \
+    BUILTIN_TAP(SUM, CAST W01 / D, r0[j + 1]);                                 \
+    BUILTIN_TAP(SUM, CAST W02 / D, r0[j + 2]);                                 \
+    BUILTIN_TAP(SUM, CAST W10 / D, r1[j]);                                     \
+    BUILTIN_TAP(SUM, CAST W11 / D, r1[j + 1]);                                 \
+    BUILTIN_TAP(SUM, CAST W12 / D, r1[j + 2]);                                 \
+    BUILTIN_TAP(SUM, CAST W20 / D, r2[j]);                                     \
+    BUILTIN_TAP(SUM, CAST W21 / D, r2[j + 1]);                                 \
+    BUILTIN_TAP(SUM, CAST W22 / D, r2[j + 2])
 
-    double sharpen[3][3] = {{0, -1, 0},
-                            {-1, 5, -1},
-                            {0, -1, 0}};
+/* Sum over the kernel of the pixel at column j + 1 of the rows, truncated toward zero like sum_over_kernel() */
+#define BUILTIN_SUM(NAME, D, W00, W01, W02, W10, W11, W12, W20, W21, W22)                         \
+    static inline int builtin_sum_##NAME(const unsigned char *r0, const unsigned char *r1,        \
+                                         const unsigned char *r2, int j)                          \
+    {                                                                                             \
+        if ((D & (D - 1)) == 0)                                                                   \
+        {                                                                                         \
+            int sum = 0;                                                                          \
+            BUILTIN_TAPS(sum, 1, W00, W01, W02, W10, W11, W12, W20, W21, W22, (int));             \
+            return sum / D;                                                                       \
+        }                                                                                         \
+        double sum = 0;                                                                           \
+        BUILTIN_TAPS(sum, D, W00, W01, W02, W10, W11, W12, W20, W21, W22, (double));              \
+        return sum;                                                                               \
+    }                                                                                             \
+                                                                                                  \
+    static int convolve_row_##NAME(const void *rows[3], void *out, int n,                         \
+                                   const struct simd_plan *plan)                                  \
+    {                                                                                             \
+        (void)plan;                                                                               \
+        const unsigned char *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];                          \
+        unsigned char *dst = out;                                                                 \
+        for (int j = 0; j < n; ++j)                                                               \
+        {                                                                                         \
+            int val = builtin_sum_##NAME(r0, r1, r2, j);                                          \
+            dst[j] = val < 0 ? 0 : val > 255 ? 255 : val;                                         \
+        }                                                                                         \
+        return n;                                                                                 \
+    }
 
-    double box_blur[3][3] = {{1. / 9, 1. / 9, 1. / 9},
-                             {1. / 9, 1. / 9, 1. / 9},
-                             {1. / 9, 1. / 9, 1. / 9}};
+BUILTIN_KERNELS(BUILTIN_SUM)
 
-    double gaussian_blur[3][3] = {{1. / 16, 2. / 16, 1. / 16},
-                                  {2. / 16, 4. / 16, 2. / 16},
-                                  {1. / 16, 2. / 16, 1. / 16}};
+/* Gradient magnitude of a pair of built-in kernels */
+#define BUILTIN_PAIR(NAME, X, Y)                                                            \
+    static int convolve_row_##NAME(const void *rows[3], void *out, int n,                   \
+                                   const struct simd_plan *plan)                            \
+    {                                                                                       \
+        (void)plan;                                                                         \
+        const unsigned char *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];                    \
+        unsigned char *dst = out;                                                           \
+        for (int j = 0; j < n; ++j)                                                         \
+        {                                                                                   \
+            double x = builtin_sum_##X(r0, r1, r2, j);                                      \
+            double y = builtin_sum_##Y(r0, r1, r2, j);                                      \
+            dst[j] = clamp_pixel(sqrt(x * x + y * y));                                      \
+        }                                                                                   \
+        return n;                                                                           \
+    }
 
-    double identity[3][3] = {{0, 0, 0},
-                             {0, 1, 0},
-                             {0, 0, 0}};
+BUILTIN_PAIR(sobel, edge_detect_x, edge_detect_y)
 
-    fp = fopen("out.pgm", "w");
+struct builtin_filter
+{
+    const char *name;
+    kernel_t *kernels[2];
+    convolve_row_t convolve_row;
+};
 
-    struct image *out = image_alloc(img->height, img->width);
-    pgm_write_header(out, fp);
+struct builtin_filter builtin_filters[] = {
+    {"identity", {&identity, NULL}, convolve_row_identity},
+    {"box_blur", {&box_blur, NULL}, convolve_row_box_blur},
+    {"gaussian_blur", {&gaussian_blur, NULL}, convolve_row_gaussian_blur},
+    {"sharpen", {&sharpen, NULL}, convolve_row_sharpen},
+    {"edge_detect", {&edge_detect, NULL}, convolve_row_edge_detect},
+    {"edge_detect2", {&edge_detect2, NULL}, convolve_row_edge_detect2},
+    {"edge_detect_x", {&edge_detect_x, NULL}, convolve_row_edge_detect_x},
+    {"edge_detect_y", {&edge_detect_y, NULL}, convolve_row_edge_detect_y},
+    {"sobel", {&edge_detect_x, &edge_detect_y}, convolve_row_sobel},
+};
 
-    struct image imgtop;
-    imgtop.width = img->width;
-    imgtop.height = img->height / 2 + 1;
-    imgtop.raster = img->raster;
+#define NBUILTIN_FILTERS (int)(sizeof(builtin_filters) / sizeof(builtin_filters[0]))
 
-    struct image outtop;
-    outtop.width = imgtop.width;
-    outtop.height = imgtop.height - 1;
-    outtop.raster = out->raster;
+struct builtin_filter *
+builtin_find(const char *name)
+{
+    for (int i = 0; i < NBUILTIN_FILTERS; ++i)
+        if (strcmp(builtin_filters[i].name, name) == 0)
+            return &builtin_filters[i];
+    return NULL;
+}
+
+/* The plan of simd_plan_init() for 8-bit images */
+void builtin_plan_init(struct simd_plan *self, kernel_t *kernels[2])
+{
+    simd_plan_init(self, kernels, 255);
+    if (self->convolve_row != NULL)
+        return;
+
+    /* No vector path : the specialized row of a built-in kernel, else the generic scalar loop */
+    for (int i = 0; i < NBUILTIN_FILTERS; ++i)
+    {
+        if (builtin_filters[i].kernels[0] == kernels[0] && builtin_filters[i].kernels[1] == kernels[1])
+        {
+            self->convolve_row = builtin_filters[i].convolve_row;
+            break;
+        }
+    }
+}
 
-    // kernel_t *kernels[] = {&identity, NULL};
-    // kernel_t *kernels[] = {&box_blur, NULL};
-    kernel_t *kernels[] = {&edge_detect2, NULL};
-    // kernel_t *kernels[] = {&sharpen, NULL};
-    // kernel_t *kernels[] = {&edge_detect_x, &edge_detect_y};
+static void convolve_tile(struct image *img, struct image *out,
+                          int row_begin, int row_end, int col_begin, int col_end,
+                          const struct simd_plan *plan)
+{
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        const void *rows[3] = {img->raster[row - 1] + col_begin - 1,
+                               img->raster[row] + col_begin - 1,
+                               img->raster[row + 1] + col_begin - 1};
+        convolve_interior_row(plan, rows, out->raster[row] + col_begin, col_end - col_begin);
+    }
+}
 
-    fflush(fp); // Important to flush before the fork; otherwise the current buffer is flushed twice (because copied in the two address space)
-    int pid = fork();
+/* Convolve the rows [row_begin, row_end) and columns [col_begin, col_end) of img into out */
+void convolve_rect(struct image *img, kernel_t *kernels[2], struct image *out,
+                   int row_begin, int row_end, int col_begin, int col_end)
+{
+    int height = img->height;
+    int width = img->width;
 
-    if (pid == 0)
+    /* Border strips : the first and last rows, then the first and last columns */
+    for (int row = row_begin; row < row_end; ++row)
     {
-        convolve(&imgtop, kernels, &outtop);
-        pgm_write_raster(&outtop, fp);
-        return 0;
+        if (row == 0 || row == height - 1 || width < 3)
+        {
+            for (int col = col_begin; col < col_end; ++col)
+                convolve_border_pixel(img, kernels, out, row, col);
+        }
+        else
+        {
+            if (col_begin == 0)
+                convolve_border_pixel(img, kernels, out, row, 0);
+            if (col_end == width)
+                convolve_border_pixel(img, kernels, out, row, width - 1);
+        }
     }
 
-    struct image imgbottom;
-    imgbottom.width = img->width;
-    imgbottom.height = img->height - imgtop.height + 1;
-    imgbottom.raster = &img->raster[imgtop.height - 1];
+    if (width < 3)
+        return;
+
+    /* Interior tiles */
+    struct simd_plan plan;
+    builtin_plan_init(&plan, kernels);
 
-    struct image outbottom;
-    outbottom.width = imgbottom.width;
-    outbottom.height = imgbottom.height;
-    outbottom.raster = &out->raster[imgtop.height - 1];
-    convolve(&imgbottom, kernels, &outbottom);
-    outbottom.raster = &out->raster[imgtop.height];
+    int first = MAX(row_begin, 1);
+    int last = MIN(row_end, height - 1);
+    int col_first = MAX(col_begin, 1);
+    int col_last = MIN(col_end, width - 1);
+    int block_rows = MAX(1, TILE_CACHE_SIZE / MIN(width, TILE_WIDTH) - 2);
+    for (int row = first; row < last; row += block_rows)
+    {
+        int row_end_block = MIN(row + block_rows, last);
+        for (int col = col_first; col < col_last; col += TILE_WIDTH)
+            convolve_tile(img, out, row, row_end_block,
+                          col, MIN(col + TILE_WIDTH, col_last), &plan);
+    }
+}
 
-    wait(NULL);
+/* Convolve the rows [row_begin, row_end) of img into the same rows of out */
+void convolve_band(struct image *img, kernel_t *kernels[2], struct image *out,
+                   int row_begin, int row_end)
+{
+    convolve_rect(img, kernels, out, row_begin, row_end, 0, img->width);
+}
 
-    pgm_write_raster(&outbottom, fp);
+void convolve_tiled(struct image *img, kernel_t *kernels[2], struct image *out)
+{
+    convolve_band(img, kernels, out, 0, img->height);
+}
+
+/*
+ * Check mode : on small synthetic images, the row of every built-in filter is
+ * compared with the generic scalar row of its plan over the interior rows, and
+ * convolve_tiled() with convolve() over the whole image, at every vector level
+ * down to the built-in rows. Returns the number of mismatches.
+ */
+int check_builtin(void)
+{
+    /* A single pixel, a column, a row, and odd widths around the vector lanes */
+    const int sizes[][2] = {{1, 1}, {7, 1}, {1, 7}, {3, 3}, {5, 17}, {4, 33}, {9, 67}};
+    int saved_level = simd_level;
+    int max_level = simd_level >= 0 ? simd_level : simd_supported();
+    int nfailed = 0;
+
+    srand(0);
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); ++s)
+    {
+        int height = sizes[s][0];
+        int width = sizes[s][1];
+        struct image *img = image_alloc(height, width);
+        struct image *ref = image_alloc(height, width);
+        struct image *out = image_alloc(height, width);
+        unsigned char *builtin_row = malloc(width);
+        unsigned char *scalar_row = malloc(width);
+        if (img == NULL || ref == NULL || out == NULL || builtin_row == NULL || scalar_row == NULL)
+        {
+            fprintf(stderr, "Unable to allocate the %dx%d check images\n", height, width);
+            return nfailed + 1;
+        }
+        for (int i = 0; i < height; ++i)
+            for (int j = 0; j < width; ++j)
+                img->raster[i][j] = rand() % 256;
+
+        for (int f = 0; f < NBUILTIN_FILTERS; ++f)
+        {
+            struct builtin_filter *filter = &builtin_filters[f];
+            struct simd_plan plan;
+            simd_level = SIMD_NONE;
+            simd_plan_init(&plan, filter->kernels, 255);
+            for (int row = 1; row < height - 1 && width >= 3; ++row)
+            {
+                const void *rows[3] = {img->raster[row - 1], img->raster[row], img->raster[row + 1]};
+                filter->convolve_row(rows, builtin_row, width - 2, &plan);
+                convolve_row_scalar(rows, scalar_row, width - 2, &plan);
+                if (memcmp(builtin_row, scalar_row, width - 2) != 0)
+                {
+                    fprintf(stderr, "%s %dx%d : the built-in row differs from the scalar one at row %d\n",
+                            filter->name, height, width, row);
+                    ++nfailed;
+                    break;
+                }
+            }
+
+            convolve(img, filter->kernels, ref);
+            for (int level = max_level; level >= SIMD_NONE; --level)
+            {
+                simd_level = level;
+                convolve_tiled(img, filter->kernels, out);
+                for (int row = 0; row < height; ++row)
+                {
+                    if (memcmp(out->raster[row], ref->raster[row], width) != 0)
+                    {
+                        fprintf(stderr, "[%s] %s %dx%d : convolve_tiled() differs from convolve() at row %d\n",
+                                simd_names[level], filter->name, height, width, row);
+                        ++nfailed;
+                        break;
+                    }
+                }
+            }
+        }
+
+        free(builtin_row);
+        free(scalar_row);
+        image_free(img);
+        image_free(ref);
+        image_free(out);
+    }
+
+    simd_level = saved_level;
+    printf("%d filter(s), %s\n", NBUILTIN_FILTERS, nfailed ? "FAILED" : "all outputs identical");
+    return nfailed;
+}
+
+/*
+ * Band decomposition : worker i convolves the rows
+ * [i * height / nworkers, (i + 1) * height / nworkers) of the output, or only
+ * loads them from source when load is set.
+ * Returns 0 if every worker succeeded.
+ */
+static int fork_bands(struct image *img, kernel_t *kernels[2], struct image *out, int nworkers,
+                      const struct band_source *source, int load)
+{
+    int failed = 0;
+    for (int i = 0; i < nworkers; ++i)
+    {
+        int row_begin = (int)((long)i * img->height / nworkers);
+        int row_end = (int)((long)(i + 1) * img->height / nworkers);
+
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            /* The workers already started still write to out : wait for them */
+            perror("fork");
+            failed = 1;
+            break;
+        }
+        if (pid == 0)
+        {
+            if (source != NULL)
+                worker_pin(i, nworkers);
+            if (load)
+                _exit(band_load(img, source, row_begin, row_end) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+            convolve_band(img, kernels, out, row_begin, row_end);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    int status;
+    while (wait(&status) > 0)
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            failed = 1;
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * source is NULL when img is already loaded; otherwise every worker first
+ * loads the band it convolves next.
+ */
+int convolve_fork(struct image *img, kernel_t *kernels[2], struct image *out, int nworkers,
+                  const struct band_source *source)
+{
+    nworkers = MAX(1, MIN(nworkers, img->height));
+
+    if (source != NULL && fork_bands(img, kernels, out, nworkers, source, 1) != 0)
+        return -1;
+    return fork_bands(img, kernels, out, nworkers, source, 0);
+}
+
+/*
+ * Thread backend : the image is split into many small tiles, numbered in
+ * row-major order. Each worker starts with a contiguous range of tiles in its
+ * own deque and takes them from the front. A worker whose deque is empty
+ * steals the back half of the range of another worker, so a band that is
+ * slower than the others (more border handling, a busy core) gets shared.
+ * No task is created once the workers run : when every deque is empty, the
+ * image is done.
+ */
+
+#define TASK_TILE_ROWS 32
+#define TASK_TILE_COLS 1024
+
+struct tile_deque
+{
+    pthread_mutex_t lock;
+    int top;    /* next tile taken by the owner */
+    int bottom; /* one past the last tile */
+};
+
+struct tile_job
+{
+    struct image *img;
+    kernel_t **kernels;
+    struct image *out;
+    int ntiles_x;
+    int nworkers;
+    int pinned; /* the workers run on the NUMA node of their band */
+    struct tile_deque *deques;
+};
+
+struct tile_worker
+{
+    struct tile_job *job;
+    int id;
+};
+
+/* Returns the next tile of deque, -1 if it is empty */
+static int tile_deque_pop(struct tile_deque *deque)
+{
+    int tile = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom)
+        tile = deque->top++;
+    pthread_mutex_unlock(&deque->lock);
+    return tile;
+}
+
+/* Moves the back half of the range of victim to thief; returns 0 on success */
+static int tile_deque_steal(struct tile_deque *thief, struct tile_deque *victim)
+{
+    int top = 0;
+    int bottom = 0;
+    pthread_mutex_lock(&victim->lock);
+    if (victim->top < victim->bottom)
+    {
+        bottom = victim->bottom;
+        top = victim->bottom - (victim->bottom - victim->top + 1) / 2;
+        victim->bottom = top;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (top == bottom)
+        return -1;
+
+    pthread_mutex_lock(&thief->lock);
+    thief->top = top;
+    thief->bottom = bottom;
+    pthread_mutex_unlock(&thief->lock);
+    return 0;
+}
+
+static void *tile_worker_run(void *arg)
+{
+    struct tile_worker *self = (struct tile_worker *)arg;
+    struct tile_job *job = self->job;
+    struct tile_deque *own = &job->deques[self->id];
+
+    if (job->pinned)
+        worker_pin(self->id, job->nworkers);
+
+    for (;;)
+    {
+        int tile = tile_deque_pop(own);
+        if (tile < 0)
+        {
+            int stolen = 0;
+            for (int i = 1; i < job->nworkers && !stolen; ++i)
+                stolen = tile_deque_steal(own, &job->deques[(self->id + i) % job->nworkers]) == 0;
+            if (!stolen)
+                break;
+            continue;
+        }
+
+        int row = tile / job->ntiles_x * TASK_TILE_ROWS;
+        int col = tile % job->ntiles_x * TASK_TILE_COLS;
+        convolve_rect(job->img, job->kernels, job->out,
+                      row, MIN(row + TASK_TILE_ROWS, job->img->height),
+                      col, MIN(col + TASK_TILE_COLS, job->img->width));
+    }
+    return NULL;
+}
+
+struct band_loader
+{
+    struct image *img;
+    const struct band_source *source;
+    int id;
+    int nworkers;
+    int pin;
+    int status;
+};
+
+static void *band_loader_run(void *arg)
+{
+    struct band_loader *self = (struct band_loader *)arg;
+    int row_begin = (int)((long)self->id * self->img->height / self->nworkers);
+    int row_end = (int)((long)(self->id + 1) * self->img->height / self->nworkers);
+
+    if (self->pin)
+        worker_pin(self->id, self->nworkers);
+    self->status = band_load(self->img, self->source, row_begin, row_end);
+    return NULL;
+}
+
+/* Each thread loads its band of img; the bands of the threads that cannot start are loaded here */
+static int load_bands_threads(struct image *img, const struct band_source *source, int nworkers)
+{
+    struct band_loader *loaders = (struct band_loader *)calloc(nworkers, sizeof(struct band_loader));
+    pthread_t *threads = (pthread_t *)calloc(nworkers, sizeof(pthread_t));
+    int *started = (int *)calloc(nworkers, sizeof(int));
+    if (loaders == NULL || threads == NULL || started == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the thread pool\n");
+        free(loaders);
+        free(threads);
+        free(started);
+        return -1;
+    }
+
+    for (int i = 0; i < nworkers; ++i)
+    {
+        loaders[i] = (struct band_loader){img, source, i, nworkers, 1, 0};
+        started[i] = pthread_create(&threads[i], NULL, band_loader_run, &loaders[i]) == 0;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < nworkers; ++i)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+        {
+            loaders[i].pin = 0;
+            band_loader_run(&loaders[i]);
+        }
+        failed |= loaders[i].status != 0;
+    }
+
+    free(loaders);
+    free(threads);
+    free(started);
+    return failed ? -1 : 0;
+}
+
+/*
+ * source is NULL when img is already loaded; otherwise every worker first
+ * loads a band of rows, about the ones of its initial tiles.
+ */
+int convolve_threads(struct image *img, kernel_t *kernels[2], struct image *out, int nworkers,
+                     const struct band_source *source)
+{
+    int ntiles_x = (img->width + TASK_TILE_COLS - 1) / TASK_TILE_COLS;
+    int ntiles_y = (img->height + TASK_TILE_ROWS - 1) / TASK_TILE_ROWS;
+    int ntiles = ntiles_x * ntiles_y;
+    nworkers = MAX(1, MIN(nworkers, ntiles));
+
+    if (source != NULL && load_bands_threads(img, source, nworkers) != 0)
+        return -1;
+
+    struct tile_job job = {img, kernels, out, ntiles_x, nworkers, source != NULL, NULL};
+    job.deques = (struct tile_deque *)calloc(nworkers, sizeof(struct tile_deque));
+    struct tile_worker *workers = (struct tile_worker *)calloc(nworkers, sizeof(struct tile_worker));
+    pthread_t *threads = (pthread_t *)calloc(nworkers, sizeof(pthread_t));
+    if (job.deques == NULL || workers == NULL || threads == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the thread pool\n");
+        free(job.deques);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+
+    for (int i = 0; i < nworkers; ++i)
+    {
+        pthread_mutex_init(&job.deques[i].lock, NULL);
+        job.deques[i].top = (int)((long)i * ntiles / nworkers);
+        job.deques[i].bottom = (int)((long)(i + 1) * ntiles / nworkers);
+        workers[i].job = &job;
+        workers[i].id = i;
+    }
+
+    int started = 0;
+    for (; started < nworkers; ++started)
+    {
+        int err = pthread_create(&threads[started], NULL, tile_worker_run, &workers[started]);
+        if (err != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    /* The workers that did start steal the tiles of the others */
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < nworkers; ++i)
+        pthread_mutex_destroy(&job.deques[i].lock);
+    free(job.deques);
+    free(workers);
+    free(threads);
+    return started == 0 ? -1 : 0;
+}
+
+/*
+ * Benchmark
+ *
+ * Synthetic images of each size (in megapixels) go through every kernel, with
+ * both backends and 1, 2, 4, ... workers up to the maximum. Each measure is
+ * the best of as many runs as fit in BENCH_MIN_SECONDS (at least one). The
+ * results are written as CSV, one line per measure :
+ *   backend    fork or threads
+ *   kernel     name of the kernel
+ *   megapixels, width, height
+ *   workers
+ *   seconds    best wall-clock time of a run
+ *   mpixels_per_s
+ *   cycles_per_pixel  time stamp counter cycles per pixel, summed over the
+ *                     workers (-1 when the counter is not available)
+ *   efficiency  speedup over one worker of the same backend, divided by the
+ *               number of workers
+ */
+
+#define BENCH_MIN_SECONDS 0.5
+#define BENCH_MAX_SIZES 16
+#define BENCH_DEFAULT_SIZES "1,4,16,100,400"
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long long bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (long long)__rdtsc();
+#else
+    return -1;
+#endif
+}
+
+/* 1, 2, 4, ... and max_workers itself */
+static int bench_next_workers(int nworkers, int max_workers)
+{
+    if (nworkers == max_workers)
+        return max_workers + 1;
+    return MIN(2 * nworkers, max_workers);
+}
+
+/* Parses a comma-separated list of sizes in megapixels; returns their number or -1 */
+int bench_parse_sizes(const char *spec, double *sizes, int max_sizes)
+{
+    int nsizes = 0;
+    const char *p = spec;
+    while (*p != '\0')
+    {
+        char *end;
+        double size = strtod(p, &end);
+        if (end == p || size <= 0 || nsizes == max_sizes || (*end != ',' && *end != '\0'))
+        {
+            fprintf(stderr, "Invalid benchmark sizes : %s\n", spec);
+            return -1;
+        }
+        sizes[nsizes++] = size;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return nsizes;
+}
+
+/* A square image of about megapixels pixels, with a reproducible noisy gradient */
+struct image *
+bench_image(double megapixels)
+{
+    int side = MAX(1, (int)sqrt(megapixels * 1e6));
+    struct image *img = image_alloc(side, side);
+    if (img == NULL)
+        return NULL;
+
+    unsigned int seed = 1;
+    for (int i = 0; i < side; ++i)
+    {
+        for (int j = 0; j < side; ++j)
+        {
+            seed = seed * 1103515245 + 12345;
+            img->raster[i][j] = (unsigned char)((i + j) / 8 + (seed >> 27));
+        }
+    }
+    return img;
+}
+
+/* Best time and cycle count over the runs that fit in BENCH_MIN_SECONDS */
+static int bench_run(struct image *img, kernel_t *kernels[2], struct image *out, int use_threads,
+                     int nworkers, double *best, long long *best_cycles)
+{
+    *best = -1;
+    *best_cycles = -1;
+    double start = bench_now();
+    do
+    {
+        long long c0 = bench_cycles();
+        double t0 = bench_now();
+        int status = use_threads ? convolve_threads(img, kernels, out, nworkers, NULL)
+                                 : convolve_fork(img, kernels, out, nworkers, NULL);
+        double elapsed = bench_now() - t0;
+        long long cycles = c0 < 0 ? -1 : bench_cycles() - c0;
+        if (status != 0)
+            return -1;
+
+        if (*best < 0 || elapsed < *best)
+        {
+            *best = elapsed;
+            *best_cycles = cycles;
+        }
+    } while (bench_now() - start < BENCH_MIN_SECONDS);
+    return 0;
+}
+
+int benchmark(struct builtin_filter *filters, int nfilters, const double *sizes, int nsizes,
+              int use_threads, int both_backends, int max_workers, FILE *fp)
+{
+    fprintf(fp, "backend,kernel,megapixels,width,height,workers,seconds,mpixels_per_s,"
+                "cycles_per_pixel,efficiency\n");
+
+    for (int s = 0; s < nsizes; ++s)
+    {
+        struct image *img = bench_image(sizes[s]);
+        struct image *out = img == NULL ? NULL : image_alloc(img->height, img->width);
+        if (out == NULL)
+        {
+            fprintf(stderr, "Unable to allocate a %g megapixel benchmark image\n", sizes[s]);
+            if (img != NULL)
+                image_free(img);
+            return -1;
+        }
+        double npixels = (double)img->height * img->width;
+
+        for (int backend = 0; backend < 2; ++backend)
+        {
+            if (!both_backends && backend != use_threads)
+                continue;
+
+            for (int k = 0; k < nfilters; ++k)
+            {
+                double base = 0;
+                for (int nworkers = 1; nworkers <= max_workers;
+                     nworkers = bench_next_workers(nworkers, max_workers))
+                {
+                    double best;
+                    long long best_cycles;
+                    if (bench_run(img, filters[k].kernels, out, backend, nworkers, &best, &best_cycles) != 0)
+                    {
+                        fprintf(stderr, "A worker failed\n");
+                        image_free(img);
+                        image_free(out);
+                        return -1;
+                    }
+
+                    if (nworkers == 1)
+                        base = best;
+                    double cycles_per_pixel = best_cycles < 0 ? -1 : best_cycles * nworkers / npixels;
+                    fprintf(fp, "%s,%s,%g,%d,%d,%d,%.6f,%.2f,%.3f,%.3f\n",
+                            backend ? "threads" : "fork", filters[k].name, sizes[s], img->width, img->height,
+                            nworkers, best, npixels / best * 1e-6, cycles_per_pixel, base / (best * nworkers));
+                    fflush(fp);
+                }
+            }
+        }
+
+        image_free(img);
+        image_free(out);
+    }
+    return 0;
+}
+
+void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-n nworkers] [--backend=fork|threads] [--filter=name] [--simd=none|sse2|avx2] "
+                    "[--first-touch] [--hugetlb] filename1 [filename2]\n",
+            progname);
+    fprintf(stderr, "       %s [-n max_workers] [--backend=fork|threads] --bench [--sizes=mp1,mp2,...]\n",
+            progname);
+    fprintf(stderr, "       %s [--simd=none|sse2|avx2] --check\n", progname);
+    fprintf(stderr, "The output is written to out.pgm when filename2 is omitted; "
+                    "nworkers defaults to get_nprocs() and the backend to fork\n");
+    fprintf(stderr, "--bench writes CSV measures for every kernel on synthetic images of each size "
+                    "in megapixels (default %s), for both backends unless one is given\n",
+            BENCH_DEFAULT_SIZES);
+    fprintf(stderr, "--check compares the rows of the filters and every vector path up to --simd with convolve() "
+                    "on small synthetic images\n");
+    fprintf(stderr, "The filter defaults to edge_detect2 and is one of :");
+    for (int i = 0; i < NBUILTIN_FILTERS; ++i)
+        fprintf(stderr, " %s", builtin_filters[i].name);
+    fprintf(stderr, "\n--simd lowers the vector path, down to the specialized scalar rows of the filters\n");
+    fprintf(stderr, "--first-touch makes every worker read its own band of the input, so that its pages "
+                    "are placed on the NUMA node of the worker\n");
+    fprintf(stderr, "--hugetlb maps the large rasters on explicit huge pages when the system has reserved some\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int nworkers = get_nprocs();
+    int use_threads = 0;
+    int backend_set = 0;
+    int bench_mode = 0;
+    int check_mode = 0;
+    int first_touch = 0;
+    struct builtin_filter *filter = builtin_find("edge_detect2");
+    double bench_sizes[BENCH_MAX_SIZES];
+    int nbench_sizes = bench_parse_sizes(BENCH_DEFAULT_SIZES, bench_sizes, BENCH_MAX_SIZES);
+
+    const struct option options[] = {
+        {"backend", required_argument, NULL, 'b'},
+        {"bench", no_argument, NULL, 'B'},
+        {"check", no_argument, NULL, 'c'},
+        {"sizes", required_argument, NULL, 'z'},
+        {"first-touch", no_argument, NULL, 'T'},
+        {"hugetlb", no_argument, NULL, 'H'},
+        {"filter", required_argument, NULL, 'f'},
+        {"simd", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'B':
+            bench_mode = 1;
+            break;
+        case 'c':
+            check_mode = 1;
+            break;
+        case 'T':
+            first_touch = 1;
+            break;
+        case 'H':
+            raster_hugetlb = 1;
+            break;
+        case 'f':
+            filter = builtin_find(optarg);
+            if (filter == NULL)
+            {
+                fprintf(stderr, "Unknown filter : %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            simd_level = -1;
+            for (int level = SIMD_NONE; level <= SIMD_AVX2; ++level)
+                if (strcmp(optarg, simd_names[level]) == 0)
+                    simd_level = level;
+            if (simd_level < 0)
+            {
+                fprintf(stderr, "Unknown SIMD level : %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'z':
+            nbench_sizes = bench_parse_sizes(optarg, bench_sizes, BENCH_MAX_SIZES);
+            if (nbench_sizes < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'b':
+            backend_set = 1;
+            if (strcmp(optarg, "fork") == 0)
+                use_threads = 0;
+            else if (strcmp(optarg, "threads") == 0)
+                use_threads = 1;
+            else
+            {
+                fprintf(stderr, "Unknown backend : %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            nworkers = atoi(optarg);
+            if (nworkers < 1)
+            {
+                fprintf(stderr, "Invalid number of workers : %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (check_mode)
+        return check_builtin() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (bench_mode)
+    {
+        int status = benchmark(builtin_filters, NBUILTIN_FILTERS, bench_sizes, nbench_sizes,
+                               use_threads, !backend_set, nworkers, stdout);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (argc - optind < 1 || argc - optind > 2)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *output = argc - optind == 2 ? argv[optind + 1] : "out.pgm";
+
+    /* pgm_create() would truncate the mapped input before it is read */
+    if (same_file(argv[optind], output))
+    {
+        fprintf(stderr, "The output is the input file : %s\n", output);
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Files are mapped when possible : the workers then read the input and
+     * write their band of the output file directly in the page cache. Otherwise
+     * the rasters live in shared anonymous memory and go through stdio. With
+     * --first-touch, the input is read by the workers instead of being mapped.
+     */
+    struct band_source source_storage;
+    struct band_source *source = NULL;
+    struct image *img = NULL;
+    if (first_touch)
+    {
+        img = pgm_open_bands(argv[optind], &source_storage);
+        if (img != NULL)
+            source = &source_storage;
+    }
+    else
+        img = pgm_map(argv[optind]);
+    if (img == NULL && errno == EINVAL)
+        return EXIT_FAILURE;
+    if (img == NULL)
+    {
+        FILE *fp = fopen(argv[optind], "r");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open input file : %s\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+
+        img = pgm_parse(fp);
+        fclose(fp);
+        if (img == NULL)
+            return EXIT_FAILURE;
+    }
+
+    struct image *out = pgm_create(output, img->height, img->width);
+    int mapped_output = out != NULL;
+    if (out == NULL)
+        out = image_alloc(img->height, img->width);
+    if (out == NULL)
+    {
+        fprintf(stderr, "Unable to allocate image struct\n");
+        return EXIT_FAILURE;
+    }
+
+    int status = use_threads ? convolve_threads(img, filter->kernels, out, nworkers, source)
+                             : convolve_fork(img, filter->kernels, out, nworkers, source);
+    if (source != NULL)
+        close(source->fd);
+    if (status != 0)
+    {
+        fprintf(stderr, "A worker failed\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Only the parent writes an unmapped output, once every band is done */
+    if (!mapped_output)
+    {
+        FILE *fp = fopen(output, "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open output file : %s\n", output);
+            return EXIT_FAILURE;
+        }
+
+        pgm_write_header(out, fp);
+        pgm_write_raster(out, fp);
+        fclose(fp);
+    }
 
-    fclose(fp);
     image_free(img);
     image_free(out);
 
@@ -0,0 +1,69 @@
+#!/bin/bash
+# Scaling of the parallel pipeline : wall time for 1, 2, 4, ... max_workers on a generated corpus
+# Usage : ./bench.sh [megabytes] [max_workers]
+# The corpus has a Zipf-like vocabulary, so that the merge input grows with the number of workers,
+# and some lines start with separators, so that chunks of the workers do too
+# Every output is checked against the one of the script.sh chain
+set -e
+
+megabytes=${1:-100}
+max_workers=${2:-64}
+corpus=bench_corpus.txt
+reference=bench_reference.txt
+output=bench_output.txt
+
+gcc -O2 pipeline.c -o pipeline
+g++ -O2 merge_sum.cpp -o merge_sum
+
+if [ ! -f $corpus ] || [ $(stat -c %s $corpus) -ne $((megabytes * 1000000)) ]; then
+    awk -v bytes=$((megabytes * 1000000)) 'BEGIN {
+        srand(1)
+        split("abcdefghijklmnopqrstuvwxyz", letters, "")
+        split(" , . ; ! ? 1 A", extras, " ")
+        line = ""
+        while (written < bytes) {
+            n = int(exp(rand() * log(1000000)))
+            word = ""
+            do {
+                word = word letters[n % 26 + 1]
+                n = int(n / 26)
+            } while (n > 0)
+            if (rand() < 0.05)
+                word = word extras[int(rand() * 8) + 1]
+            line = line == "" ? (rand() < 0.3 ? ", " : "") word : line " " word
+            if (length(line) > 70) {
+                if (written + length(line) + 1 > bytes)
+                    line = substr(line, 1, bytes - written - 1)
+                print line
+                written += length(line) + 1
+                line = ""
+            }
+        }
+    }' > $corpus
+fi
+
+if [ ! -f $reference ] || [ $corpus -nt $reference ]; then
+    cat $corpus | tr -s '[:digit:]' ' ' | tr '[A-Z]' '[a-z]' | tr -s '[:punct:]' ' ' | tr -s '\n\f\t\r ' '\n' |
+        sort | uniq -c > $reference
+fi
+
+echo "workers,seconds,mb_per_s,speedup"
+base=
+for ((n = 1; n <= max_workers; n *= 2)); do
+    start=$(date +%s.%N)
+    ./pipeline $corpus $n > $output
+    end=$(date +%s.%N)
+    if ! cmp -s $output $reference; then
+        echo "The output of $n workers differs from the one of script.sh" >&2
+        exit 1
+    fi
+    awk -v n=$n -v s=$start -v e=$end -v mb=$megabytes -v base=$base 'BEGIN {
+        t = e - s
+        if (base == "")
+            base = t
+        printf "%d,%.3f,%.1f,%.2f\n", n, t, mb / t, base / t
+    }'
+    if [ -z "$base" ]; then
+        base=$(awk -v s=$start -v e=$end 'BEGIN { print e - s }')
+    fi
+done
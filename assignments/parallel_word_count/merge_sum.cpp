@@ -1,34 +1,145 @@
 #include <algorithm>
+#include <cerrno>
+#include <clocale>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <queue>
 #include <string>
-#include <map>
+#include <vector>
 
-int main()
+#include "word_table.h"
+
+/*
+ * Sums the counts of words written by uniq -c.
+ *
+ * Without arguments, the outputs of the workers are read concatenated on stdin,
+ * summed in the hash table of word_table.h and sorted once at the end. With one
+ * file per worker, whose lines are already in the order of sort, the files are
+ * merged with a heap : the counts of a word are summed as its lines meet, with
+ * only the current line of each file in memory, and the sums are written in the
+ * format of uniq -c.
+ */
+
+int sum_stdin()
 {
-    std::map<std::string, int> counts;
+    word_table counts;
+    word_table_init(&counts, WORD_TABLE_MIN_CAPACITY);
     int count;
     std::string word;
     while (std::cin >> count >> word)
     {
-        counts[word] += count;
+        word_table_add(&counts, word.data(), word.size(), count);
     }
 
+    /* In the order of std::string, like the std::map this replaces */
+    std::size_t n;
+    word_count *entries = word_table_sorted(&counts, word_compare_bytes, &n);
+
     int max = 0;
-    std::for_each(counts.begin(),
-                  counts.end(),
-                  [&max](const auto &pair) {
-                      max = std::max(max, pair.second);
+    std::for_each(entries,
+                  entries + n,
+                  [&max](const auto &entry) {
+                      max = std::max(max, static_cast<int>(entry.count));
                   });
 
     int ndigits = static_cast<int>(std::ceil(std::log10(max)));
 
-    for (const auto &pair : counts)
+    for (std::size_t i = 0; i < n; ++i)
     {
-        std::cout << "  " << std::setw(ndigits) << pair.second << " ";
-        std::cout << pair.first << '\n';
+        std::cout << "  " << std::setw(ndigits) << entries[i].count << " ";
+        std::cout.write(entries[i].word, entries[i].length) << '\n';
     }
 
+    free(entries);
+    word_table_free(&counts);
     return 0;
-}
\ No newline at end of file
+}
+
+struct merge_input
+{
+    std::ifstream stream;
+    const char *filename;
+    long line_number = 0;
+    long count;
+    std::string word;
+
+    /* Reads the next "%7d %s" line; false at the end of the file */
+    bool next()
+    {
+        std::string line;
+        if (!std::getline(stream, line))
+            return false;
+        ++line_number;
+
+        /* The word follows the count and one space, and is empty without them */
+        char *end;
+        errno = 0;
+        count = std::strtol(line.c_str(), &end, 10);
+        if (end == line.c_str() || errno == ERANGE || (*end != '\0' && *end != ' '))
+        {
+            std::cerr << "Unable to read a count at " << filename << ':' << line_number << '\n';
+            std::exit(1);
+        }
+        word.assign(*end == ' ' ? end + 1 : end);
+        return true;
+    }
+};
+
+int merge_files(int nfiles, char **filenames)
+{
+    std::vector<std::unique_ptr<merge_input>> inputs;
+    for (int i = 0; i < nfiles; ++i)
+    {
+        inputs.emplace_back(new merge_input);
+        inputs.back()->filename = filenames[i];
+        inputs.back()->stream.open(filenames[i]);
+        if (!inputs.back()->stream)
+        {
+            std::cerr << "Unable to open " << filenames[i] << '\n';
+            return 1;
+        }
+    }
+
+    /* Min-heap of the inputs by their current word */
+    auto greater = [&inputs](int a, int b) {
+        const std::string &x = inputs[b]->word, &y = inputs[a]->word;
+        return word_order(x.c_str(), x.size(), y.c_str(), y.size()) < 0;
+    };
+    std::priority_queue<int, std::vector<int>, decltype(greater)> heap(greater);
+    for (int i = 0; i < nfiles; ++i)
+        if (inputs[i]->next())
+            heap.push(i);
+
+    while (!heap.empty())
+    {
+        std::string word = inputs[heap.top()]->word;
+        long count = 0;
+        while (!heap.empty() && inputs[heap.top()]->word == word)
+        {
+            int i = heap.top();
+            heap.pop();
+            count += inputs[i]->count;
+            if (inputs[i]->next())
+                heap.push(i);
+        }
+        std::cout << std::setw(7) << count << ' ' << word << '\n';
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    std::ios::sync_with_stdio(false);
+    std::setlocale(LC_ALL, "");
+
+    if (argc > 1)
+        return merge_files(argc - 1, argv + 1);
+    return sum_stdin();
+}
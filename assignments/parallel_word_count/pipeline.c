@@ -1,8 +1,12 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <locale.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdlib.h>
@@ -71,6 +75,128 @@ void uniq_count()
     execlp("uniq", "uniq", "-c", NULL);
 }
 
+/*
+ * Native word count
+ *
+ * count_words() does in one process what the tr, sort and uniq -c tasks do :
+ * every run of digits, punctuation and whitespace ends a word, A-Z are
+ * lowered, and the words are counted in a hash table, then written in the
+ * order of sort and the format of uniq -c. Like tr, the byte classes come from
+ * the locale; like sort, words are ordered by strcoll then byte by byte.
+ *
+ * The tr chain turns every run of separators into one newline, so the only
+ * empty line it can emit is the first one, when the input starts with a
+ * separator : that empty word is counted too.
+ *
+ * The hash table is the one of word_table.h, shared with merge_sum.cpp.
+ */
+
+#include "word_table.h"
+
+#define CHUNK_SIZE (1 << 20)
+
+/* byte_map[c] is the lowered byte, or -1 for a separator */
+static int byte_map[256];
+
+void byte_map_init()
+{
+    for (int c = 0; c < 256; ++c)
+    {
+        if (isdigit(c) || ispunct(c) || c == '\n' || c == '\f' || c == '\t' || c == '\r' || c == ' ')
+            byte_map[c] = -1;
+        else if (c >= 'A' && c <= 'Z')
+            byte_map[c] = c - 'A' + 'a';
+        else
+            byte_map[c] = c;
+    }
+}
+
+/* Writes the words in the order of sort and the format of uniq -c */
+void word_table_print(struct word_table *table, FILE *stream)
+{
+    size_t n;
+    struct word_count *words = word_table_sorted(table, word_compare, &n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        fprintf(stream, "%7ld ", words[i].count);
+        fwrite(words[i].word, 1, words[i].length, stream);
+        putc('\n', stream);
+    }
+    free(words);
+}
+
+/* 0 in the workers whose input does not start at the beginning of the file, see run_parallel() */
+static int reads_file_start = 1;
+
+void count_words()
+{
+    setlocale(LC_ALL, "");
+    byte_map_init();
+
+    struct word_table table;
+    word_table_init(&table, WORD_TABLE_MIN_CAPACITY);
+
+    char *buf = malloc(CHUNK_SIZE);
+    size_t capacity = BUF_SIZE;
+    char *word = malloc(capacity);
+    if (buf == NULL || word == NULL)
+    {
+        perror("Buffer allocation");
+        exit(1);
+    }
+
+    size_t length = 0;
+    int first = 1;
+    ssize_t nread;
+    while ((nread = read(STDIN_FILENO, buf, CHUNK_SIZE)) > 0)
+    {
+        /*
+         * tr -s turns the separators that start the file into one empty line,
+         * which uniq counts as the empty word. The other workers start after
+         * a newline of the file, their leading separators are not a word.
+         */
+        if (first && reads_file_start && byte_map[(unsigned char)buf[0]] < 0)
+            word_table_add(&table, "", 0, 1);
+        first = 0;
+
+        for (ssize_t i = 0; i < nread; ++i)
+        {
+            int c = byte_map[(unsigned char)buf[i]];
+            if (c >= 0)
+            {
+                if (length == capacity)
+                {
+                    capacity *= 2;
+                    word = realloc(word, capacity);
+                    if (word == NULL)
+                    {
+                        perror("Buffer allocation");
+                        exit(1);
+                    }
+                }
+                word[length++] = c;
+            }
+            else if (length > 0)
+            {
+                word_table_add(&table, word, length, 1);
+                length = 0;
+            }
+        }
+    }
+    if (nread < 0)
+    {
+        perror("Input read");
+        exit(1);
+    }
+    if (length > 0)
+        word_table_add(&table, word, length, 1);
+
+    word_table_print(&table, stdout);
+    fflush(stdout);
+    word_table_free(&table);
+    exit(0);
+}
+
 typedef void (*task_t)();
 
 #define READ_END 0
@@ -100,20 +226,90 @@ void run_pipeline(task_t *tasks, int ntask)
     tasks[0]();
 }
 
+#define SCATTER_CHUNK_SIZE (1 << 20)
+
+/* Writes the whole buffer, across partial writes */
+int write_all(int fd, const char *buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t nwritten = write(fd, buf, size);
+        if (nwritten < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += nwritten;
+        size -= nwritten;
+    }
+    return 0;
+}
+
+/*
+ * Sends stdin to the workers in turn, by chunks of about SCATTER_CHUNK_SIZE
+ * bytes cut after their last newline, so that every worker gets whole lines.
+ * The bytes after the cut start the next chunk; the buffer only grows for a
+ * line longer than a chunk.
+ */
 void scatter(int fds[], int n)
 {
-    int nread = 0;
-    char *line = NULL;
-    size_t len = 0;
-    FILE *stream = stdin;
+    size_t capacity = SCATTER_CHUNK_SIZE;
+    char *buf = malloc(capacity);
+    if (buf == NULL)
+    {
+        perror("Scatter buffer allocation");
+        exit(1);
+    }
+
+    size_t pending = 0;
     int i = 0;
-    while ((nread = getline(&line, &len, stream)) > 0)
+    ssize_t nread;
+    while ((nread = read(STDIN_FILENO, buf + pending, capacity - pending)) != 0)
     {
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Scatter read");
+            exit(1);
+        }
+
+        size_t size = pending + nread;
+        char *last = memrchr(buf, '\n', size);
+        if (last == NULL)
+        {
+            pending = size;
+            if (pending == capacity)
+            {
+                capacity *= 2;
+                buf = realloc(buf, capacity);
+                if (buf == NULL)
+                {
+                    perror("Scatter buffer allocation");
+                    exit(1);
+                }
+            }
+            continue;
+        }
+
+        size_t chunk = last - buf + 1;
+        if (write_all(fds[i], buf, chunk) != 0)
+        {
+            perror("Scatter write");
+            exit(1);
+        }
         i = (i + 1) % n;
-        write(fds[i], line, nread);
-        len = 0;
-        line = NULL;
+        pending = size - chunk;
+        memmove(buf, buf + chunk, pending);
+    }
+
+    if (pending > 0 && write_all(fds[i], buf, pending) != 0)
+    {
+        perror("Scatter write");
+        exit(1);
     }
+    free(buf);
 }
 
 void create_pipes(int readfds[], int writefds[], int n)
@@ -121,7 +317,11 @@ void create_pipes(int readfds[], int writefds[], int n)
     for (int i = 0; i < n; ++i)
     {
         int pipefd[2];
-        pipe(pipefd);
+        if (pipe(pipefd) == -1)
+        {
+            fprintf(stderr, "Pipe creation: %s\n", strerror(errno));
+            exit(1);
+        }
         readfds[i] = pipefd[READ_END];
         writefds[i] = pipefd[WRITE_END];
     }
@@ -133,46 +333,60 @@ void closefds(int fds[], int n)
         close(fds[i]);
 }
 
-void run_parallel(task_t *tasks, int ntask, int input_fds[], int output_fds[], int nfds)
+/*
+ * Forks one worker per pair of fds. Worker i reads input_fds[i] and writes
+ * output_fds[i] as its stdin and stdout, and closes every other fd of the
+ * three arrays : a worker holding the write end of another pipe would keep
+ * its reader from ever seeing the end of file.
+ */
+void run_parallel(task_t *tasks, int ntask, int input_fds[], int output_fds[], int other_fds[], int nfds)
 {
     for (int i = 0; i < nfds; ++i)
     {
         pid_t pid = fork();
+        if (pid == -1)
+        {
+            fprintf(stderr, "Worker fork: %s\n", strerror(errno));
+            exit(1);
+        }
         if (pid == 0)
         {
+            reads_file_start = i == 0; /* scatter() sends the first chunk to the first worker */
             dup2(input_fds[i], STDIN_FILENO);
             dup2(output_fds[i], STDOUT_FILENO);
-            closefds(input_fds, i);
-            closefds(&input_fds[i + 1], nfds - i - 1);
-            closefds(output_fds, i);
-            closefds(&output_fds[i + 1], nfds - i - 1);
+            closefds(input_fds, nfds);
+            closefds(output_fds, nfds);
+            closefds(other_fds, nfds);
             run_pipeline(tasks, ntask);
             exit(0);
         }
     }
 }
 
+/*
+ * Replaces the process by merge_sum, which merges the sorted outputs of the
+ * workers as the files /dev/fd/N of the fds
+ */
 void merge_sum(int fds[], int n)
 {
-    int pipefd[2];
-    pipe(pipefd);
-
-    pid_t pid = fork();
-    if (pid == 0)
+    char names[n][32];
+    char *args[n + 2];
+    args[0] = "merge_sum";
+    for (int i = 0; i < n; ++i)
     {
-        close(pipefd[READ_END]);
-        dup2(pipefd[WRITE_END], STDOUT_FILENO);
-        cat(fds, n);
+        snprintf(names[i], sizeof(names[i]), "/dev/fd/%d", fds[i]);
+        args[i + 1] = names[i];
     }
-    closefds(fds, n);
-    close(pipefd[WRITE_END]);
-    dup2(pipefd[READ_END], STDIN_FILENO);
-    execl("merge_sum", "merge_sum", NULL);
+    args[n + 1] = NULL;
+
+    execv("merge_sum", args);
+    fprintf(stderr, "merge_sum exec: %s\n", strerror(errno));
+    exit(1);
 }
 
-void run_parallel_pipeline(task_t *tasks, int ntask)
+/* Runs the tasks on n workers fed by scatter() and merges their counts */
+void run_parallel_pipeline(task_t *tasks, int ntask, int n)
 {
-    const int n = 2;
     int input_rfds[n];
     int input_wfds[n];
 
@@ -191,7 +405,7 @@ void run_parallel_pipeline(task_t *tasks, int ntask)
     int output_wfds[n];
     create_pipes(output_rfds, output_wfds, n);
 
-    run_parallel(tasks, ntask, input_rfds, output_wfds, n);
+    run_parallel(tasks, ntask, input_rfds, output_wfds, output_rfds, n);
     closefds(input_rfds, n);
 
     closefds(output_wfds, n);
@@ -200,9 +414,16 @@ void run_parallel_pipeline(task_t *tasks, int ntask)
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage : %s filename [nworkers]\n", argv[0]);
+        return -1;
+    }
+
+    int nworkers = argc == 3 ? atoi(argv[2]) : get_nprocs();
+    if (nworkers < 1)
     {
-        fprintf(stderr, "Usage : %s filename\n", argv[0]);
+        fprintf(stderr, "Invalid number of workers : %s\n", argv[2]);
         return -1;
     }
 
@@ -213,19 +434,26 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    dup2(fd, STDIN_FILENO);
-
-    const int ntask = 7;
-    task_t pipeline[] = {
-        cat_stdin,
-        remove_digits,
-        remove_punct,
-        replace_uppercase_by_lowercase,
-        replace_whitespace_by_newline,
-        sort,
-        uniq_count};
+    if (fd != STDIN_FILENO)
+    {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
 
-    run_parallel_pipeline(pipeline, ntask);
+    /* The native count, or the exec chain it replaces */
+    const int ntask = 1;
+    task_t pipeline[] = {count_words};
+    // const int ntask = 7;
+    // task_t pipeline[] = {
+    //     cat_stdin,
+    //     remove_digits,
+    //     remove_punct,
+    //     replace_uppercase_by_lowercase,
+    //     replace_whitespace_by_newline,
+    //     sort,
+    //     uniq_count};
+
+    run_parallel_pipeline(pipeline, ntask, nworkers);
     // run_pipeline(pipeline, ntask);
 
     return 0;
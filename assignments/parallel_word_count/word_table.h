@@ -0,0 +1,276 @@
+/*
+ * Word count table
+ *
+ * Shared by count_words() in pipeline.c and the stdin mode of merge_sum.cpp;
+ * it is written in the common subset of C and C++.
+ *
+ * The table is flat : the words are copied one after the other in the blocks
+ * of an arena, and the slots keep a pointer to them with their length and the
+ * high half of their hash. A byte of tag per slot, 0 when empty or 0x80 | 7
+ * bits of the hash, lets a lookup test a group of 16 slots with one SSE2
+ * comparison and only compare the words whose tag matches. Words are never
+ * removed, so a probe ends at the first group with an empty slot.
+ *
+ * A slot stays at 24 bytes : the full hash would make it 32, a third more
+ * memory for the table of a worker. The half kept rules out most of the
+ * memcmp() calls, and word_table_grow() recomputes the hashes from the arena,
+ * which costs about one more hash per word over all the doublings.
+ */
+
+#ifndef WORD_TABLE_H
+#define WORD_TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define WORD_TABLE_MIN_CAPACITY 1024
+#define WORD_GROUP_SIZE 16
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct arena
+{
+    struct arena_block *blocks;
+};
+
+struct word_count
+{
+    char *word;
+    long count;
+    uint32_t length;
+    uint32_t check; /* the high half of the hash */
+};
+
+struct word_table
+{
+    unsigned char *tags; /* capacity tags, then a copy of the first group for the probes that wrap */
+    struct word_count *slots;
+    size_t capacity;     /* a power of 2 */
+    size_t size;
+    struct arena arena;
+};
+
+/* FNV-1a */
+static uint64_t word_hash(const char *word, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)word[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Bump allocation in blocks of ARENA_BLOCK_SIZE bytes, or one block for a larger word */
+static char *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_block *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (struct arena_block *)malloc(sizeof(struct arena_block) + block_size);
+        if (block == NULL)
+        {
+            perror("Arena allocation");
+            exit(1);
+        }
+        block->used = 0;
+        block->size = block_size;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    char *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+static void arena_free(struct arena *arena)
+{
+    while (arena->blocks != NULL)
+    {
+        struct arena_block *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+static void word_table_init(struct word_table *table, size_t capacity)
+{
+    table->tags = (unsigned char *)calloc(capacity + WORD_GROUP_SIZE, 1);
+    table->slots = (struct word_count *)malloc(capacity * sizeof(struct word_count));
+    if (table->tags == NULL || table->slots == NULL)
+    {
+        perror("Word table allocation");
+        exit(1);
+    }
+    table->capacity = capacity;
+    table->size = 0;
+    table->arena.blocks = NULL;
+}
+
+static void word_table_free(struct word_table *table)
+{
+    free(table->tags);
+    free(table->slots);
+    arena_free(&table->arena);
+}
+
+static unsigned char word_tag(uint64_t hash)
+{
+    return 0x80 | (hash & 0x7f);
+}
+
+/* Bit i set when tags[i] == tag, for the WORD_GROUP_SIZE tags of the group */
+static unsigned word_group_match(const unsigned char *tags, unsigned char tag)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)tags);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < WORD_GROUP_SIZE; ++i)
+        bits |= (unsigned)(tags[i] == tag) << i;
+    return bits;
+#endif
+}
+
+static void word_table_set_tag(struct word_table *table, size_t i, unsigned char tag)
+{
+    table->tags[i] = tag;
+    if (i < WORD_GROUP_SIZE)
+        table->tags[table->capacity + i] = tag;
+}
+
+/* The slot of the word, or the empty slot where it goes */
+static size_t word_table_find(struct word_table *table, const char *word, size_t length,
+                              uint64_t hash)
+{
+    size_t mask = table->capacity - 1;
+    unsigned char tag = word_tag(hash);
+    for (size_t group = (hash >> 7) & mask;; group = (group + WORD_GROUP_SIZE) & mask)
+    {
+        const unsigned char *tags = table->tags + group;
+        for (unsigned bits = word_group_match(tags, tag); bits != 0; bits &= bits - 1)
+        {
+            size_t i = (group + __builtin_ctz(bits)) & mask;
+            struct word_count *slot = &table->slots[i];
+            if (slot->check == hash >> 32 && slot->length == length && memcmp(slot->word, word, length) == 0)
+                return i;
+        }
+
+        unsigned empty = word_group_match(tags, 0);
+        if (empty != 0)
+            return (group + __builtin_ctz(empty)) & mask;
+    }
+}
+
+static void word_table_grow(struct word_table *table)
+{
+    struct word_table grown;
+    word_table_init(&grown, 2 * table->capacity);
+    for (size_t i = 0; i < table->capacity; ++i)
+    {
+        if (table->tags[i] == 0)
+            continue;
+        struct word_count *slot = &table->slots[i];
+        size_t j = word_table_find(&grown, slot->word, slot->length, word_hash(slot->word, slot->length));
+        word_table_set_tag(&grown, j, table->tags[i]);
+        grown.slots[j] = *slot;
+    }
+    grown.size = table->size;
+    grown.arena = table->arena;
+    free(table->tags);
+    free(table->slots);
+    *table = grown;
+}
+
+static void word_table_add(struct word_table *table, const char *word, size_t length, long count)
+{
+    uint64_t hash = word_hash(word, length);
+    size_t i = word_table_find(table, word, length, hash);
+    if (table->tags[i] == 0)
+    {
+        /* At most 7/8 full, so that probes stay short */
+        if (8 * (table->size + 1) > 7 * table->capacity)
+        {
+            word_table_grow(table);
+            i = word_table_find(table, word, length, hash);
+        }
+
+        struct word_count *slot = &table->slots[i];
+        slot->word = arena_alloc(&table->arena, length + 1);
+        memcpy(slot->word, word, length);
+        slot->word[length] = '\0';
+        slot->count = 0;
+        slot->length = length;
+        slot->check = hash >> 32;
+        word_table_set_tag(table, i, word_tag(hash));
+        table->size++;
+    }
+    table->slots[i].count += count;
+}
+
+/* Byte by byte, a prefix first */
+static inline int word_order_bytes(const char *a, size_t alength, const char *b, size_t blength)
+{
+    int order = memcmp(a, b, alength < blength ? alength : blength);
+    if (order != 0)
+        return order;
+    return (alength > blength) - (alength < blength);
+}
+
+/* The order of sort : the collation of the locale, then the bytes; both words end with a NUL */
+static inline int word_order(const char *a, size_t alength, const char *b, size_t blength)
+{
+    int order = strcoll(a, b);
+    return order != 0 ? order : word_order_bytes(a, alength, b, blength);
+}
+
+/* word_order_bytes() and word_order() for qsort() */
+static inline int word_compare_bytes(const void *a, const void *b)
+{
+    const struct word_count *x = (const struct word_count *)a;
+    const struct word_count *y = (const struct word_count *)b;
+    return word_order_bytes(x->word, x->length, y->word, y->length);
+}
+
+static inline int word_compare(const void *a, const void *b)
+{
+    const struct word_count *x = (const struct word_count *)a;
+    const struct word_count *y = (const struct word_count *)b;
+    return word_order(x->word, x->length, y->word, y->length);
+}
+
+/* The *n entries of the table in a new array sorted by compare; their words stay in the arena */
+static struct word_count *
+word_table_sorted(struct word_table *table, int (*compare)(const void *, const void *), size_t *n)
+{
+    struct word_count *words = (struct word_count *)malloc((table->size + 1) * sizeof(struct word_count));
+    if (words == NULL)
+    {
+        perror("Word list allocation");
+        exit(1);
+    }
+
+    *n = 0;
+    for (size_t i = 0; i < table->capacity; ++i)
+        if (table->tags[i] != 0)
+            words[(*n)++] = table->slots[i];
+    qsort(words, *n, sizeof(struct word_count), compare);
+    return words;
+}
+
+#endif
@@ -0,0 +1,862 @@
+/*
+ * Vectorized 3x3 convolution engine
+ *
+ * This file is included by image_processing.c and by filter.c (the image
+ * filtering assignment), after their definitions of kernel_t, MIN and MAX, so
+ * that both programs run the same row functions. It only sees rows of pixels :
+ * the images, their borders and the tiling stay with the programs, which call
+ * convolve_interior_row() for the interior pixels of each row.
+ */
+
+#ifndef CONVOLVE_SIMD_H
+#define CONVOLVE_SIMD_H
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Vectorized 3x3 path
+ *
+ * Kernels whose coefficients are all of the form w / 2^shift, with w an
+ * integer and a result that fits in 16 bits (edge_detect, edge_detect2,
+ * sharpen, Sobel, gaussian_blur, ...) are computed exactly with 16-bit integer
+ * lanes : 16 pixels per SSE2 iteration, 32 per AVX2 iteration. The sum over
+ * the kernel is truncated toward zero like the conversion of a double to an
+ * int in sum_over_kernel(), so the output is identical to convolve().
+ *
+ * The other kernels (box_blur) are computed in double precision with AVX2,
+ * with the taps accumulated in the same order as sum_over_kernel(); single
+ * precision lanes would not give the same rounding.
+ *
+ * 16-bit images use 32-bit integer lanes (16 pixels per AVX2 iteration) with
+ * the same fixed-point kernels, or double precision lanes for the others.
+ *
+ * The scalar path uses the same fixed-point kernels when they are exact.
+ *
+ * Pairs of kernels (Sobel) are accumulated in the same pass over the 3x3
+ * neighborhood, and their magnitude is computed with gradient_norm : the
+ * exact sqrt(x * x + y * y), the same in single precision from a reciprocal
+ * square root estimate refined once (fast, may differ by one), |x| + |y| (l1)
+ * or max(|x|, |y|) (linf), the last two without any floating point.
+ *
+ * In quantized mode (quantize), the other kernels are rounded to the nearest
+ * fixed-point kernel with 16-bit weights and also go through the integer
+ * paths, on 32-bit lanes : 8 pixels per AVX2 register instead of 4 doubles.
+ * Their output may then differ from the one of convolve() by the rounding of
+ * the weights, which check_quantized() reports.
+ *
+ * The path is chosen at runtime from the CPU features, and simd_level can
+ * lower it to compare the paths or to force the scalar one.
+ */
+
+#define SIMD_NONE 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+
+const char *simd_names[] = {"none", "sse2", "avx2"};
+
+int simd_level = -1; /* -1 : the best level supported by the CPU */
+
+int quantize = 0; /* 1 : kernels without an exact fixed-point form are rounded to one */
+
+/*
+ * Median of 9 values in 19 compare-exchanges, the median ends in P[4] :
+ * sorting network of "Fast median search : an ANSI C implementation",
+ * N. Devillard. SORT(A, B) puts the smaller value in A; it works the same on
+ * scalars and on vectors of pixels.
+ */
+#define MEDIAN9_NETWORK(P, SORT)                                                        \
+    do                                                                                  \
+    {                                                                                   \
+        SORT(P[1], P[2]) SORT(P[4], P[5]) SORT(P[7], P[8]) SORT(P[0], P[1])             \
+        SORT(P[3], P[4]) SORT(P[6], P[7]) SORT(P[1], P[2]) SORT(P[4], P[5])             \
+        SORT(P[7], P[8]) SORT(P[0], P[3]) SORT(P[5], P[8]) SORT(P[4], P[7])             \
+        SORT(P[3], P[6]) SORT(P[1], P[4]) SORT(P[2], P[5]) SORT(P[4], P[7])             \
+        SORT(P[4], P[2]) SORT(P[6], P[4]) SORT(P[4], P[2])                              \
+    } while (0)
+
+/* Same arguments as convolve_row_t, returns the number of leading medians computed */
+typedef int (*median9_row_t)(const void *rows[3], void *dst, int n);
+
+#define NORM_L2 0
+#define NORM_FAST 1
+#define NORM_L1 2
+#define NORM_LINF 3
+
+const char *norm_names[] = {"l2", "fast", "l1", "linf"};
+
+int gradient_norm = NORM_L2;
+
+/* Magnitude of the gradient (x, y) given by a pair of kernels */
+static double gradient_magnitude(double x, double y)
+{
+    switch (gradient_norm)
+    {
+    case NORM_FAST: /* the scalar estimate is a single precision square root */
+        return sqrtf((float)(x * x + y * y));
+    case NORM_L1:
+        return fabs(x) + fabs(y);
+    case NORM_LINF:
+        return MAX(fabs(x), fabs(y));
+    default:
+        return sqrt(x * x + y * y);
+    }
+}
+
+#define QKERNEL_MAX_SHIFT 8
+#define QKERNEL_QUANT_SHIFT 24
+
+struct simd_plan;
+
+struct qkernel
+{
+    short w[3][3];
+    int shift;
+};
+
+/*
+ * rows point to the pixels above, at and below the first output pixel, minus
+ * one column; the pixels are unsigned char or unsigned short depending on
+ * maxval. Returns the number of leading pixels of dst that have been computed.
+ */
+typedef int (*convolve_row_t)(const void *rows[3], void *dst, int n, const struct simd_plan *plan);
+
+struct simd_plan
+{
+    int nkernels;
+    kernel_t *kernels[2];
+    struct qkernel q[2];
+    int integer; /* 1 : the sums are computed with q instead of kernels, in every path */
+    int norm;    /* gradient_norm for pairs of kernels */
+    int maxval;
+    convolve_row_t convolve_row;
+};
+
+/* Largest absolute value of a sum over pixels up to maxval, before the shift */
+long qkernel_bound(const struct qkernel *self, int maxval)
+{
+    long bound = 0;
+    for (int k = 0; k < 3; ++k)
+        for (int l = 0; l < 3; ++l)
+            bound += labs((long)self->w[k][l]) * maxval;
+    return bound;
+}
+
+/*
+ * Returns 0 if kernel has an exact fixed-point form whose sums over pixels
+ * up to maxval fit in an int.
+ */
+int qkernel_init(struct qkernel *self, double kernel[3][3], int maxval)
+{
+    for (int shift = 0; shift <= QKERNEL_MAX_SHIFT; ++shift)
+    {
+        int exact = 1;
+        long bound = 0;
+        for (int k = 0; k < 3 && exact; ++k)
+        {
+            for (int l = 0; l < 3 && exact; ++l)
+            {
+                double w = ldexp(kernel[k][l], shift);
+                if (w != (long)w || fabs(w) > 32767)
+                    exact = 0;
+                else
+                    bound += labs((long)w) * maxval;
+            }
+        }
+
+        if (!exact)
+            continue;
+        if (bound > INT_MAX)
+            return -1;
+
+        for (int k = 0; k < 3; ++k)
+            for (int l = 0; l < 3; ++l)
+                self->w[k][l] = (short)ldexp(kernel[k][l], shift);
+        self->shift = shift;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Rounds kernel to the nearest fixed-point kernel, with as many fractional
+ * bits as the int sums allow, up to QKERNEL_QUANT_SHIFT. Exact kernels keep
+ * their exact form. Returns -1 if the weights are too large for 16 bits.
+ */
+int qkernel_quantize(struct qkernel *self, double kernel[3][3], int maxval)
+{
+    if (qkernel_init(self, kernel, maxval) == 0)
+        return 0;
+
+    for (int shift = QKERNEL_QUANT_SHIFT; shift >= 0; --shift)
+    {
+        int fits = 1;
+        for (int k = 0; k < 3; ++k)
+        {
+            for (int l = 0; l < 3; ++l)
+            {
+                long w = lround(ldexp(kernel[k][l], shift));
+                if (labs(w) > 32767)
+                    fits = 0;
+                else
+                    self->w[k][l] = (short)w;
+            }
+        }
+        self->shift = shift;
+        if (fits && qkernel_bound(self, maxval) <= INT_MAX)
+            return 0;
+    }
+    return -1;
+}
+
+int simd_supported(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+#endif
+    return SIMD_NONE;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Truncate sum / 2^shift toward zero */
+__attribute__((target("sse2"))) static __m128i
+qkernel_shift_sse2(__m128i sum, int shift)
+{
+    __m128i bias = _mm_and_si128(_mm_srai_epi16(sum, 15), _mm_set1_epi16((1 << shift) - 1));
+    return _mm_sra_epi16(_mm_add_epi16(sum, bias), _mm_cvtsi32_si128(shift));
+}
+
+/* sqrt(s) as s / sqrt(s), from the estimate of 1 / sqrt(s) refined once; 0 for s = 0 */
+__attribute__((target("sse2"))) static __m128
+fast_sqrt_sse2(__m128 s)
+{
+    __m128 r = _mm_rsqrt_ps(s);
+    __m128 half_srr = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), s), _mm_mul_ps(r, r));
+    r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), half_srr));
+    return _mm_and_ps(_mm_mul_ps(s, r), _mm_cmpgt_ps(s, _mm_setzero_ps()));
+}
+
+/* Gradient magnitude of x and y limited to 255, for 8 pixels */
+__attribute__((target("sse2"))) static __m128i
+magnitude_sse2(__m128i x, __m128i y, int norm)
+{
+    __m128i max = _mm_set1_epi16(255);
+    if (norm == NORM_L1 || norm == NORM_LINF)
+    {
+        __m128i ax = _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+        __m128i ay = _mm_max_epi16(y, _mm_sub_epi16(_mm_setzero_si128(), y));
+        __m128i mag = norm == NORM_L1 ? _mm_adds_epi16(ax, ay) : _mm_max_epi16(ax, ay);
+        return _mm_min_epi16(mag, max);
+    }
+
+    __m128i lo = _mm_unpacklo_epi16(x, y);
+    __m128i hi = _mm_unpackhi_epi16(x, y);
+    __m128 slo = _mm_cvtepi32_ps(_mm_madd_epi16(lo, lo));
+    __m128 shi = _mm_cvtepi32_ps(_mm_madd_epi16(hi, hi));
+    __m128 mlo = norm == NORM_FAST ? fast_sqrt_sse2(slo) : _mm_sqrt_ps(slo);
+    __m128 mhi = norm == NORM_FAST ? fast_sqrt_sse2(shi) : _mm_sqrt_ps(shi);
+    mlo = _mm_min_ps(mlo, _mm_set1_ps(255));
+    mhi = _mm_min_ps(mhi, _mm_set1_ps(255));
+    return _mm_packs_epi32(_mm_cvttps_epi32(mlo), _mm_cvttps_epi32(mhi));
+}
+
+__attribute__((target("sse2"))) static int
+convolve_row_int16_sse2(const void *src[3], void *out, int n, const struct simd_plan *plan)
+{
+    const unsigned char **rows = (const unsigned char **)src;
+    unsigned char *dst = (unsigned char *)out;
+    const __m128i zero = _mm_setzero_si128();
+    int j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i lo[2] = {zero, zero};
+        __m128i hi[2] = {zero, zero};
+        for (int k = 0; k < 3; ++k)
+        {
+            for (int l = 0; l < 3; ++l)
+            {
+                __m128i p = _mm_loadu_si128((const __m128i *)(rows[k] + j + l));
+                __m128i plo = _mm_unpacklo_epi8(p, zero);
+                __m128i phi = _mm_unpackhi_epi8(p, zero);
+                for (int m = 0; m < plan->nkernels; ++m)
+                {
+                    short w = plan->q[m].w[k][l];
+                    if (w == 0)
+                        continue;
+                    __m128i wv = _mm_set1_epi16(w);
+                    lo[m] = _mm_add_epi16(lo[m], _mm_mullo_epi16(plo, wv));
+                    hi[m] = _mm_add_epi16(hi[m], _mm_mullo_epi16(phi, wv));
+                }
+            }
+        }
+
+        for (int m = 0; m < plan->nkernels; ++m)
+        {
+            lo[m] = qkernel_shift_sse2(lo[m], plan->q[m].shift);
+            hi[m] = qkernel_shift_sse2(hi[m], plan->q[m].shift);
+        }
+        if (plan->nkernels == 2)
+        {
+            lo[0] = magnitude_sse2(lo[0], lo[1], plan->norm);
+            hi[0] = magnitude_sse2(hi[0], hi[1], plan->norm);
+        }
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_packus_epi16(lo[0], hi[0]));
+    }
+    return j;
+}
+
+__attribute__((target("avx2"))) static __m256i
+qkernel_shift_avx2(__m256i sum, int shift)
+{
+    __m256i bias = _mm256_and_si256(_mm256_srai_epi16(sum, 15), _mm256_set1_epi16((1 << shift) - 1));
+    return _mm256_sra_epi16(_mm256_add_epi16(sum, bias), _mm_cvtsi32_si128(shift));
+}
+
+/* Same as fast_sqrt_sse2() for 8 values */
+__attribute__((target("avx2"))) static __m256
+fast_sqrt_avx2(__m256 s)
+{
+    __m256 r = _mm256_rsqrt_ps(s);
+    __m256 half_srr = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), s), _mm256_mul_ps(r, r));
+    r = _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(1.5f), half_srr));
+    return _mm256_and_ps(_mm256_mul_ps(s, r), _mm256_cmp_ps(s, _mm256_setzero_ps(), _CMP_GT_OQ));
+}
+
+/* Same as magnitude_sse2() for 16 pixels; unpack and pack undo each other within each lane */
+__attribute__((target("avx2"))) static __m256i
+magnitude_avx2(__m256i x, __m256i y, int norm)
+{
+    __m256i max = _mm256_set1_epi16(255);
+    if (norm == NORM_L1 || norm == NORM_LINF)
+    {
+        __m256i ax = _mm256_abs_epi16(x);
+        __m256i ay = _mm256_abs_epi16(y);
+        __m256i mag = norm == NORM_L1 ? _mm256_adds_epi16(ax, ay) : _mm256_max_epi16(ax, ay);
+        return _mm256_min_epi16(mag, max);
+    }
+
+    __m256i lo = _mm256_unpacklo_epi16(x, y);
+    __m256i hi = _mm256_unpackhi_epi16(x, y);
+    __m256 slo = _mm256_cvtepi32_ps(_mm256_madd_epi16(lo, lo));
+    __m256 shi = _mm256_cvtepi32_ps(_mm256_madd_epi16(hi, hi));
+    __m256 mlo = norm == NORM_FAST ? fast_sqrt_avx2(slo) : _mm256_sqrt_ps(slo);
+    __m256 mhi = norm == NORM_FAST ? fast_sqrt_avx2(shi) : _mm256_sqrt_ps(shi);
+    mlo = _mm256_min_ps(mlo, _mm256_set1_ps(255));
+    mhi = _mm256_min_ps(mhi, _mm256_set1_ps(255));
+    return _mm256_packs_epi32(_mm256_cvttps_epi32(mlo), _mm256_cvttps_epi32(mhi));
+}
+
+__attribute__((target("avx2"))) static int
+convolve_row_int16_avx2(const void *src[3], void *out, int n, const struct simd_plan *plan)
+{
+    const unsigned char **rows = (const unsigned char **)src;
+    unsigned char *dst = (unsigned char *)out;
+    const __m256i zero = _mm256_setzero_si256();
+    int j = 0;
+    for (; j + 32 <= n; j += 32)
+    {
+        __m256i lo[2] = {zero, zero};
+        __m256i hi[2] = {zero, zero};
+        for (int k = 0; k < 3; ++k)
+        {
+            for (int l = 0; l < 3; ++l)
+            {
+                const unsigned char *src = rows[k] + j + l;
+                __m256i plo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)src));
+                __m256i phi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + 16)));
+                for (int m = 0; m < plan->nkernels; ++m)
+                {
+                    short w = plan->q[m].w[k][l];
+                    if (w == 0)
+                        continue;
+                    __m256i wv = _mm256_set1_epi16(w);
+                    lo[m] = _mm256_add_epi16(lo[m], _mm256_mullo_epi16(plo, wv));
+                    hi[m] = _mm256_add_epi16(hi[m], _mm256_mullo_epi16(phi, wv));
+                }
+            }
+        }
+
+        for (int m = 0; m < plan->nkernels; ++m)
+        {
+            lo[m] = qkernel_shift_avx2(lo[m], plan->q[m].shift);
+            hi[m] = qkernel_shift_avx2(hi[m], plan->q[m].shift);
+        }
+        if (plan->nkernels == 2)
+        {
+            lo[0] = magnitude_avx2(lo[0], lo[1], plan->norm);
+            hi[0] = magnitude_avx2(hi[0], hi[1], plan->norm);
+        }
+        /* packus works within 128-bit lanes : put the quadwords back in order */
+        __m256i packed = _mm256_packus_epi16(lo[0], hi[0]);
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    return j;
+}
+
+/*
+ * Gradient magnitude of x and y limited to maxval, for 4 pixels. The squares
+ * need double precision with 16-bit pixels; the fast norm works on their
+ * single precision value.
+ */
+__attribute__((target("avx2"))) static __m128i
+magnitude_epi32_avx2(__m128i x, __m128i y, int norm, int maxval)
+{
+    __m128i max = _mm_set1_epi32(maxval);
+    if (norm == NORM_L1 || norm == NORM_LINF)
+    {
+        __m128i ax = _mm_abs_epi32(x);
+        __m128i ay = _mm_abs_epi32(y);
+        return _mm_min_epi32(norm == NORM_L1 ? _mm_add_epi32(ax, ay) : _mm_max_epi32(ax, ay), max);
+    }
+
+    __m256d dx = _mm256_cvtepi32_pd(x);
+    __m256d dy = _mm256_cvtepi32_pd(y);
+    __m256d s = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+    if (norm == NORM_FAST)
+    {
+        __m128 mag = _mm_min_ps(fast_sqrt_sse2(_mm256_cvtpd_ps(s)), _mm_set1_ps(maxval));
+        return _mm_cvttps_epi32(mag);
+    }
+    return _mm256_cvttpd_epi32(_mm256_min_pd(_mm256_sqrt_pd(s), _mm256_set1_pd(maxval)));
+}
+
+/* 4 pixels converted to double, wide for unsigned short pixels */
+__attribute__((target("avx2"))) static inline __m256d
+load_pd_avx2(const void *src, int wide)
+{
+    if (wide)
+        return _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)src)));
+
+    int bytes;
+    memcpy(&bytes, src, sizeof(bytes));
+    return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+}
+
+__attribute__((target("avx2"))) static inline int
+convolve_row_double_avx2_generic(const void *src[3], void *out, int n, const struct simd_plan *plan,
+                                 int wide)
+{
+    int pixel_size = wide ? 2 : 1;
+    int j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128i val[2];
+        for (int m = 0; m < plan->nkernels; ++m)
+        {
+            double(*kernel)[3] = *plan->kernels[m];
+            __m256d sum = _mm256_setzero_pd();
+            for (int k = 0; k < 3; ++k)
+            {
+                for (int l = 0; l < 3; ++l)
+                {
+                    __m256d p = load_pd_avx2((const char *)src[k] + (j + l) * pixel_size, wide);
+                    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_set1_pd(kernel[k][l]), p));
+                }
+            }
+            val[m] = _mm256_cvttpd_epi32(sum);
+        }
+
+        __m128i pixels;
+        if (plan->nkernels == 2)
+            pixels = magnitude_epi32_avx2(val[0], val[1], plan->norm, plan->maxval);
+        else
+            pixels = _mm_max_epi32(_mm_min_epi32(val[0], _mm_set1_epi32(plan->maxval)),
+                                   _mm_setzero_si128());
+
+        if (wide)
+            _mm_storel_epi64((__m128i *)((unsigned short *)out + j), _mm_packus_epi32(pixels, pixels));
+        else
+        {
+            pixels = _mm_packus_epi16(_mm_packs_epi32(pixels, pixels), pixels);
+            int bytes = _mm_cvtsi128_si32(pixels);
+            memcpy((unsigned char *)out + j, &bytes, sizeof(bytes));
+        }
+    }
+    return j;
+}
+
+__attribute__((target("avx2"))) static int
+convolve_row_double_avx2(const void *src[3], void *out, int n, const struct simd_plan *plan)
+{
+    return convolve_row_double_avx2_generic(src, out, n, plan, 0);
+}
+
+__attribute__((target("avx2"))) static int
+convolve_row_double16_avx2(const void *src[3], void *out, int n, const struct simd_plan *plan)
+{
+    return convolve_row_double_avx2_generic(src, out, n, plan, 1);
+}
+
+__attribute__((target("avx2"))) static __m256i
+qkernel_shift32_avx2(__m256i sum, int shift)
+{
+    __m256i bias = _mm256_and_si256(_mm256_srai_epi32(sum, 31), _mm256_set1_epi32((1 << shift) - 1));
+    return _mm256_sra_epi32(_mm256_add_epi32(sum, bias), _mm_cvtsi32_si128(shift));
+}
+
+/* Same as magnitude_epi32_avx2() for 8 pixels */
+__attribute__((target("avx2"))) static __m256i
+magnitude32_avx2(__m256i x, __m256i y, int norm, int maxval)
+{
+    __m128i lo = magnitude_epi32_avx2(_mm256_castsi256_si128(x), _mm256_castsi256_si128(y), norm, maxval);
+    __m128i hi = magnitude_epi32_avx2(_mm256_extracti128_si256(x, 1), _mm256_extracti128_si256(y, 1),
+                                      norm, maxval);
+    return _mm256_set_m128i(hi, lo);
+}
+
+/* 8 pixels widened to 32 bits, wide for unsigned short pixels */
+__attribute__((target("avx2"))) static inline __m256i
+load_epi32_avx2(const void *src, int wide)
+{
+    if (wide)
+        return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)src));
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)src));
+}
+
+/* Fixed-point kernels on 32-bit lanes : 16-bit pixels, or 8-bit ones when the sums need more than 16 bits */
+__attribute__((target("avx2"))) static inline int
+convolve_row_int32_avx2_generic(const void *src[3], void *out, int n, const struct simd_plan *plan,
+                                int wide)
+{
+    int pixel_size = wide ? 2 : 1;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi32(plan->maxval);
+    int j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        __m256i lo[2] = {zero, zero};
+        __m256i hi[2] = {zero, zero};
+        for (int k = 0; k < 3; ++k)
+        {
+            for (int l = 0; l < 3; ++l)
+            {
+                const char *p = (const char *)src[k] + (j + l) * pixel_size;
+                __m256i plo = load_epi32_avx2(p, wide);
+                __m256i phi = load_epi32_avx2(p + 8 * pixel_size, wide);
+                for (int m = 0; m < plan->nkernels; ++m)
+                {
+                    int w = plan->q[m].w[k][l];
+                    if (w == 0)
+                        continue;
+                    __m256i wv = _mm256_set1_epi32(w);
+                    lo[m] = _mm256_add_epi32(lo[m], _mm256_mullo_epi32(plo, wv));
+                    hi[m] = _mm256_add_epi32(hi[m], _mm256_mullo_epi32(phi, wv));
+                }
+            }
+        }
+
+        for (int m = 0; m < plan->nkernels; ++m)
+        {
+            lo[m] = qkernel_shift32_avx2(lo[m], plan->q[m].shift);
+            hi[m] = qkernel_shift32_avx2(hi[m], plan->q[m].shift);
+        }
+        if (plan->nkernels == 2)
+        {
+            lo[0] = magnitude32_avx2(lo[0], lo[1], plan->norm, plan->maxval);
+            hi[0] = magnitude32_avx2(hi[0], hi[1], plan->norm, plan->maxval);
+        }
+        else
+        {
+            lo[0] = _mm256_max_epi32(_mm256_min_epi32(lo[0], max), zero);
+            hi[0] = _mm256_max_epi32(_mm256_min_epi32(hi[0], max), zero);
+        }
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo[0], hi[0]), 0xD8);
+        if (wide)
+            _mm256_storeu_si256((__m256i *)((unsigned short *)out + j), packed);
+        else
+            _mm_storeu_si128((__m128i *)((unsigned char *)out + j),
+                             _mm_packus_epi16(_mm256_castsi256_si128(packed),
+                                              _mm256_extracti128_si256(packed, 1)));
+    }
+    return j;
+}
+
+__attribute__((target("avx2"))) static int
+convolve_row_int32_avx2(const void *src[3], void *out, int n, const struct simd_plan *plan)
+{
+    return convolve_row_int32_avx2_generic(src, out, n, plan, 0);
+}
+
+__attribute__((target("avx2"))) static int
+convolve_row_int32x16_avx2(const void *src[3], void *out, int n, const struct simd_plan *plan)
+{
+    return convolve_row_int32_avx2_generic(src, out, n, plan, 1);
+}
+
+/* 3x3 medians of 16 (SSE2) or 32 (AVX2) 8-bit pixels, or 16 16-bit pixels (AVX2) */
+#define MEDIAN9_SORT_SSE2(A, B)            \
+    {                                      \
+        __m128i min_ = _mm_min_epu8(A, B); \
+        B = _mm_max_epu8(A, B);            \
+        A = min_;                          \
+    }
+
+__attribute__((target("sse2"))) static int
+median9_row_sse2(const void *src[3], void *out, int n)
+{
+    int j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i p[9];
+        for (int k = 0; k < 3; ++k)
+            for (int l = 0; l < 3; ++l)
+                p[3 * k + l] = _mm_loadu_si128((const __m128i *)((const unsigned char *)src[k] + j + l));
+        MEDIAN9_NETWORK(p, MEDIAN9_SORT_SSE2);
+        _mm_storeu_si128((__m128i *)((unsigned char *)out + j), p[4]);
+    }
+    return j;
+}
+
+#define MEDIAN9_SORT_AVX2(A, B)                                                \
+    {                                                                          \
+        __m256i min_ = wide ? _mm256_min_epu16(A, B) : _mm256_min_epu8(A, B); \
+        B = wide ? _mm256_max_epu16(A, B) : _mm256_max_epu8(A, B);            \
+        A = min_;                                                              \
+    }
+
+__attribute__((target("avx2"))) static inline int
+median9_row_avx2_generic(const void *src[3], void *out, int n, int wide)
+{
+    int pixel_size = wide ? 2 : 1;
+    int step = 32 / pixel_size;
+    int j = 0;
+    for (; j + step <= n; j += step)
+    {
+        __m256i p[9];
+        for (int k = 0; k < 3; ++k)
+            for (int l = 0; l < 3; ++l)
+                p[3 * k + l] = _mm256_loadu_si256((const __m256i *)((const char *)src[k] + (j + l) * pixel_size));
+        MEDIAN9_NETWORK(p, MEDIAN9_SORT_AVX2);
+        _mm256_storeu_si256((__m256i *)((char *)out + j * pixel_size), p[4]);
+    }
+    return j;
+}
+
+__attribute__((target("avx2"))) static int
+median9_row_avx2(const void *src[3], void *out, int n)
+{
+    return median9_row_avx2_generic(src, out, n, 0);
+}
+
+__attribute__((target("avx2"))) static int
+median9_row16_avx2(const void *src[3], void *out, int n)
+{
+    return median9_row_avx2_generic(src, out, n, 1);
+}
+
+#endif
+
+/* The vectorized 3x3 median for the pixels of maxval, NULL if there is none */
+median9_row_t median9_row_select(int maxval)
+{
+    int level = simd_supported();
+    if (simd_level >= 0)
+        level = MIN(level, simd_level);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (level >= SIMD_AVX2)
+        return maxval > 255 ? median9_row16_avx2 : median9_row_avx2;
+    if (level >= SIMD_SSE2 && maxval <= 255)
+        return median9_row_sse2;
+#else
+    (void)level;
+    (void)maxval;
+#endif
+    return NULL;
+}
+
+/* maxval is the one of the output image, it also gives the size of the pixels */
+void simd_plan_init(struct simd_plan *self, kernel_t *kernels[2], int maxval)
+{
+    self->nkernels = kernels[1] == NULL ? 1 : 2;
+    self->kernels[0] = kernels[0];
+    self->kernels[1] = kernels[1];
+    self->norm = gradient_norm;
+    self->maxval = maxval;
+    self->convolve_row = NULL;
+
+    int level = simd_supported();
+    if (simd_level >= 0)
+        level = MIN(level, simd_level);
+
+    int wide = maxval > 255;
+    int integer = 1;
+    int narrow = !wide; /* the sums fit in 16-bit lanes */
+    for (int m = 0; m < self->nkernels; ++m)
+    {
+        if (qkernel_init(&self->q[m], *kernels[m], maxval) != 0)
+            integer = 0;
+        else if (qkernel_bound(&self->q[m], maxval) > 32767)
+            narrow = 0;
+    }
+
+    if (!integer && quantize)
+    {
+        integer = 1;
+        narrow = 0;
+        for (int m = 0; m < self->nkernels; ++m)
+            if (qkernel_quantize(&self->q[m], *kernels[m], maxval) != 0)
+                integer = 0;
+    }
+    self->integer = integer;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (integer && narrow && level >= SIMD_AVX2)
+        self->convolve_row = convolve_row_int16_avx2;
+    else if (integer && narrow && level >= SIMD_SSE2)
+        self->convolve_row = convolve_row_int16_sse2;
+    else if (integer && level >= SIMD_AVX2)
+        self->convolve_row = wide ? convolve_row_int32x16_avx2 : convolve_row_int32_avx2;
+    else if (!integer && level >= SIMD_AVX2)
+        self->convolve_row = wide ? convolve_row_double16_avx2 : convolve_row_double_avx2;
+#else
+    (void)level;
+    (void)narrow;
+    (void)wide;
+#endif
+}
+
+/* Pixel j of a row, wide for unsigned short pixels */
+static inline int row_pixel(const void *row, int j, int wide)
+{
+    return wide ? ((const unsigned short *)row)[j] : ((const unsigned char *)row)[j];
+}
+
+/* Sum over the kernel of pixel j + 1 of the rows, truncated like sum_over_kernel() */
+static inline int row_sum(double kernel[3][3], const void *src[3], int j, int wide)
+{
+    double sum = 0;
+    for (int k = 0; k < 3; ++k)
+        for (int l = 0; l < 3; ++l)
+            sum += kernel[k][l] * row_pixel(src[k], j + l, wide);
+    return sum;
+}
+
+/* Same as row_sum() with a fixed-point kernel; the division truncates toward zero */
+static inline int row_qsum(const struct qkernel *q, const void *src[3], int j, int wide)
+{
+    int sum = 0;
+    for (int k = 0; k < 3; ++k)
+        for (int l = 0; l < 3; ++l)
+            sum += q->w[k][l] * row_pixel(src[k], j + l, wide);
+    return sum / (1 << q->shift);
+}
+
+static inline void row_store(void *out, int j, double val, int maxval, int wide)
+{
+    val = MAX(MIN(val, maxval), 0);
+    if (wide)
+        ((unsigned short *)out)[j] = (unsigned short)val;
+    else
+        ((unsigned char *)out)[j] = (unsigned char)val;
+}
+
+/*
+ * Same arguments as convolve_row_t, for every pixel : the sums of
+ * sum_over_kernel(), or their fixed-point form when plan->integer, so that
+ * the vectorized rows can be checked against this one.
+ */
+__attribute__((always_inline)) static inline int
+convolve_row_scalar_generic(const void *src[3], void *out, int n, const struct simd_plan *plan, int wide)
+{
+    /* Local copies : the stores to out could alias the rows and the weights otherwise */
+    const void *rows[3] = {src[0], src[1], src[2]};
+    int maxval = plan->maxval;
+    if (plan->integer)
+    {
+        struct qkernel q[2] = {plan->q[0], plan->q[plan->nkernels - 1]};
+        for (int j = 0; j < n; ++j)
+        {
+            if (plan->nkernels == 1)
+                row_store(out, j, row_qsum(&q[0], rows, j, wide), maxval, wide);
+            else
+            {
+                /* Both sums in one pass over the neighborhood */
+                int x = 0, y = 0;
+                for (int k = 0; k < 3; ++k)
+                {
+                    for (int l = 0; l < 3; ++l)
+                    {
+                        int p = row_pixel(rows[k], j + l, wide);
+                        x += q[0].w[k][l] * p;
+                        y += q[1].w[k][l] * p;
+                    }
+                }
+                row_store(out, j, gradient_magnitude(x / (1 << q[0].shift), y / (1 << q[1].shift)), maxval,
+                          wide);
+            }
+        }
+    }
+    else
+    {
+        kernel_t kernels[2];
+        memcpy(kernels[0], *plan->kernels[0], sizeof(kernel_t));
+        memcpy(kernels[1], *plan->kernels[plan->nkernels - 1], sizeof(kernel_t));
+        for (int j = 0; j < n; ++j)
+        {
+            if (plan->nkernels == 1)
+                row_store(out, j, row_sum(kernels[0], rows, j, wide), maxval, wide);
+            else
+            {
+                double x = 0, y = 0;
+                for (int k = 0; k < 3; ++k)
+                {
+                    for (int l = 0; l < 3; ++l)
+                    {
+                        int p = row_pixel(rows[k], j + l, wide);
+                        x += kernels[0][k][l] * p;
+                        y += kernels[1][k][l] * p;
+                    }
+                }
+                row_store(out, j, gradient_magnitude((int)x, (int)y), maxval, wide);
+            }
+        }
+    }
+    return n;
+}
+
+static int convolve_row_scalar(const void *src[3], void *out, int n, const struct simd_plan *plan)
+{
+    return convolve_row_scalar_generic(src, out, n, plan, 0);
+}
+
+static int convolve_row_scalar16(const void *src[3], void *out, int n, const struct simd_plan *plan)
+{
+    return convolve_row_scalar_generic(src, out, n, plan, 1);
+}
+
+/*
+ * The n interior pixels of an output row, rows as for convolve_row_t : the
+ * vectorized row of the plan, if any, then the scalar one for the pixels it
+ * leaves.
+ */
+void convolve_interior_row(const struct simd_plan *plan, const void *rows[3], void *dst, int n)
+{
+    int done = 0;
+    if (plan->convolve_row != NULL)
+        done = plan->convolve_row(rows, dst, n, plan);
+    if (done == n)
+        return;
+
+    int pixel_size = plan->maxval > 255 ? 2 : 1;
+    const void *rest[3];
+    for (int k = 0; k < 3; ++k)
+        rest[k] = (const char *)rows[k] + done * pixel_size;
+    if (pixel_size == 2)
+        convolve_row_scalar16(rest, (char *)dst + done * pixel_size, n - done, plan);
+    else
+        convolve_row_scalar(rest, (char *)dst + done * pixel_size, n - done, plan);
+}
+
+#endif
@@ -0,0 +1,677 @@
+/*
+ * Pixel-generic part of the convolution engine
+ *
+ * This file is included by image_processing.c once per pixel type, with :
+ *   PIXEL         the type of a pixel (unsigned char, unsigned short)
+ *   PIXEL_SUFFIX  the suffix of the generated functions (8, 16)
+ * so that the 8-bit and 16-bit images share the same code. The rows of the
+ * raster of struct image are read as rows of PIXEL, and the results are
+ * clamped to the maximum gray value of the output image.
+ */
+
+#define PIXEL_CONCAT2(NAME, SUFFIX) NAME##_##SUFFIX
+#define PIXEL_CONCAT(NAME, SUFFIX) PIXEL_CONCAT2(NAME, SUFFIX)
+#define T(NAME) PIXEL_CONCAT(NAME, PIXEL_SUFFIX)
+#define ROW(IMG, I) ((PIXEL *)(IMG)->raster[I])
+
+static int T(sum_over_kernel)(struct image *img, int row, int col, double kernel[3][3])
+{
+    double sum = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        int i = row + k - 1;
+        if (i < 0 || i >= img->height)
+            continue;
+        for (int l = 0; l < 3; ++l)
+        {
+            int j = col + l - 1;
+            if (j < 0 || j >= img->width)
+                continue;
+            sum += kernel[k][l] * ROW(img, i)[j];
+        }
+    }
+    return sum;
+}
+
+/* Same as the function above with a fixed-point kernel; the division truncates toward zero */
+static int T(qsum_over_kernel)(struct image *img, int row, int col, const struct qkernel *q)
+{
+    int sum = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        int i = row + k - 1;
+        if (i < 0 || i >= img->height)
+            continue;
+        for (int l = 0; l < 3; ++l)
+        {
+            int j = col + l - 1;
+            if (j < 0 || j >= img->width)
+                continue;
+            sum += q->w[k][l] * ROW(img, i)[j];
+        }
+    }
+    return sum / (1 << q->shift);
+}
+
+/* Both sums of a pair of kernels in one pass over the neighborhood, each truncated like the ones above */
+static void T(sum_pair_interior)(struct image *img, int row, int col, kernel_t *kernels[2],
+                                 double *x, double *y)
+{
+    double sum_x = 0, sum_y = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        const PIXEL *line = ROW(img, row + k - 1) + col - 1;
+        for (int l = 0; l < 3; ++l)
+        {
+            sum_x += (*kernels[0])[k][l] * line[l];
+            sum_y += (*kernels[1])[k][l] * line[l];
+        }
+    }
+    *x = (int)sum_x;
+    *y = (int)sum_y;
+}
+
+static void T(qsum_pair_interior)(struct image *img, int row, int col, const struct qkernel q[2],
+                                  double *x, double *y)
+{
+    int sum_x = 0, sum_y = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        const PIXEL *line = ROW(img, row + k - 1) + col - 1;
+        for (int l = 0; l < 3; ++l)
+        {
+            sum_x += q[0].w[k][l] * line[l];
+            sum_y += q[1].w[k][l] * line[l];
+        }
+    }
+    *x = sum_x / (1 << q[0].shift);
+    *y = sum_y / (1 << q[1].shift);
+}
+
+static PIXEL T(clamp_pixel)(double val, int maxval)
+{
+    val = MIN(val, maxval);
+    val = MAX(val, 0);
+    return (PIXEL)val;
+}
+
+/* plan is NULL or gives the fixed-point kernels to use instead of kernels */
+static void T(convolve_border_pixel)(struct image *img, kernel_t *kernels[2], struct image *out,
+                                     int row, int col, const struct simd_plan *plan)
+{
+    double val, valy;
+    if (plan != NULL && plan->integer)
+    {
+        val = T(qsum_over_kernel)(img, row, col, &plan->q[0]);
+        if (kernels[1] != NULL)
+            valy = T(qsum_over_kernel)(img, row, col, &plan->q[1]);
+    }
+    else
+    {
+        val = T(sum_over_kernel)(img, row, col, *kernels[0]);
+        if (kernels[1] != NULL)
+            valy = T(sum_over_kernel)(img, row, col, *kernels[1]);
+    }
+    if (kernels[1] != NULL)
+        val = gradient_magnitude(val, valy);
+    ROW(out, row)[col] = T(clamp_pixel)(val, out->maxval);
+}
+
+/* Same as convolve(), the reference for the other pixel types */
+void T(convolve_reference)(struct image *img, kernel_t *kernels[2], struct image *out)
+{
+    for (int row = 0; row < img->height; ++row)
+        for (int col = 0; col < img->width; ++col)
+            T(convolve_border_pixel)(img, kernels, out, row, col, NULL);
+}
+
+static double T(separable_border_pixel)(const PIXEL *src, int col, int width,
+                                        const struct separable_kernel *sep)
+{
+    int radius = sep->size / 2;
+    double sum = 0;
+    for (int l = 0; l < sep->size; ++l)
+    {
+        int j = col + l - radius;
+        if (j >= 0 && j < width)
+            sum += sep->h[l] * src[j];
+    }
+    return sum;
+}
+
+/* Horizontal pass of one source row, with zero padding outside the image */
+static void T(separable_row)(const PIXEL *src, double *dst, int width,
+                             const struct separable_kernel *sep)
+{
+    int radius = sep->size / 2;
+    int interior_begin = MIN(radius, width);
+    int interior_end = MAX(width - radius, interior_begin);
+
+    for (int col = 0; col < interior_begin; ++col)
+        dst[col] = T(separable_border_pixel)(src, col, width, sep);
+
+    for (int col = interior_begin; col < interior_end; ++col)
+    {
+        const PIXEL *line = src + col - radius;
+        double sum = 0;
+        for (int l = 0; l < sep->size; ++l)
+            sum += sep->h[l] * line[l];
+        dst[col] = sum;
+    }
+
+    for (int col = interior_end; col < width; ++col)
+        dst[col] = T(separable_border_pixel)(src, col, width, sep);
+}
+
+/* Convolve the rows [row_begin, row_end) of img into the same rows of out */
+void T(convolve_separable_band)(struct image *img, struct separable_kernel *sep, struct image *out,
+                                int row_begin, int row_end)
+{
+    int height = img->height;
+    int width = img->width;
+    int radius = sep->size / 2;
+
+    /* Ring of horizontally filtered rows : source row i is kept in slot i % size */
+    double *rows = (double *)malloc(sizeof(double) * sep->size * width);
+    double *acc = (double *)malloc(sizeof(double) * width);
+    if (rows == NULL || acc == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the separable row buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int next = MAX(row_begin - radius, 0);
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        for (; next <= MIN(row + radius, height - 1); ++next)
+            T(separable_row)(ROW(img, next), rows + (size_t)(next % sep->size) * width, width, sep);
+
+        for (int col = 0; col < width; ++col)
+            acc[col] = 0;
+
+        for (int k = 0; k < sep->size; ++k)
+        {
+            int i = row + k - radius;
+            if (i < 0 || i >= height)
+                continue;
+            const double *line = rows + (size_t)(i % sep->size) * width;
+            double v = sep->v[k];
+            for (int col = 0; col < width; ++col)
+                acc[col] += v * line[col];
+        }
+
+        PIXEL *dst = ROW(out, row);
+        for (int col = 0; col < width; ++col)
+            dst[col] = T(clamp_pixel)(acc[col], out->maxval);
+    }
+
+    free(rows);
+    free(acc);
+}
+
+static void T(convolve_tile)(struct image *img, struct image *out, int row_begin, int row_end,
+                             int col_begin, int col_end, const struct simd_plan *plan)
+{
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        const void *rows[3] = {ROW(img, row - 1) + col_begin - 1,
+                               ROW(img, row) + col_begin - 1,
+                               ROW(img, row + 1) + col_begin - 1};
+        convolve_interior_row(plan, rows, ROW(out, row) + col_begin, col_end - col_begin);
+    }
+}
+
+/* Convolve the rows [row_begin, row_end) of img into the same rows of out */
+void T(convolve_band)(struct image *img, kernel_t *kernels[2], struct image *out,
+                      int row_begin, int row_end)
+{
+    int height = img->height;
+    int width = img->width;
+
+    struct simd_plan plan;
+    simd_plan_init(&plan, kernels, out->maxval);
+
+    /* Without a vectorized path, 6 taps per pixel beat the 9 taps of the 2D sum, unless doubles are avoided */
+    struct separable_kernel sep;
+    if (plan.convolve_row == NULL && !quantize && kernels[1] == NULL && separable_init(&sep, *kernels[0]) == 0)
+    {
+        T(convolve_separable_band)(img, &sep, out, row_begin, row_end);
+        return;
+    }
+
+    /* Border strips : the first and last rows, then the first and last columns */
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        if (row == 0 || row == height - 1 || width < 3)
+        {
+            for (int col = 0; col < width; ++col)
+                T(convolve_border_pixel)(img, kernels, out, row, col, &plan);
+        }
+        else
+        {
+            T(convolve_border_pixel)(img, kernels, out, row, 0, &plan);
+            T(convolve_border_pixel)(img, kernels, out, row, width - 1, &plan);
+        }
+    }
+
+    if (width < 3)
+        return;
+
+    /* Interior tiles */
+    int first = MAX(row_begin, 1);
+    int last = MIN(row_end, height - 1);
+    int block_rows = MAX(1, TILE_CACHE_SIZE / (int)MIN(width * sizeof(PIXEL), TILE_WIDTH) - 2);
+    for (int row = first; row < last; row += block_rows)
+    {
+        int row_end_block = MIN(row + block_rows, last);
+        for (int col = 1; col < width - 1; col += TILE_WIDTH)
+            T(convolve_tile)(img, out, row, row_end_block, col, MIN(col + TILE_WIDTH, width - 1), &plan);
+    }
+}
+
+/*
+ * Quantized orientation of the gradient given by a pair of kernels, for the
+ * rows [row_begin, row_end) : see gradient_direction(). orient is an 8-bit
+ * image whatever the pixels of img.
+ */
+void T(gradient_orientation_band)(struct image *img, kernel_t *kernels[2], struct image *orient,
+                                  int row_begin, int row_end)
+{
+    struct simd_plan plan;
+    simd_plan_init(&plan, kernels, img->maxval);
+
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        for (int col = 0; col < img->width; ++col)
+        {
+            double x, y;
+            if (row == 0 || row == img->height - 1 || col == 0 || col == img->width - 1)
+            {
+                x = T(sum_over_kernel)(img, row, col, *kernels[0]);
+                y = T(sum_over_kernel)(img, row, col, *kernels[1]);
+            }
+            else if (plan.integer)
+                T(qsum_pair_interior)(img, row, col, plan.q, &x, &y);
+            else
+                T(sum_pair_interior)(img, row, col, kernels, &x, &y);
+            orient->raster[row][col] = gradient_direction(x, y);
+        }
+    }
+}
+
+/*
+ * Rank filters : the rows and columns outside of img repeat its border pixels,
+ * so that the window is always size x size pixels.
+ */
+
+#define RANK_CLAMP(I, N) MIN(MAX(I, 0), (N) - 1)
+#define RANK_SORT(A, B)          \
+    {                            \
+        PIXEL min_ = MIN(A, B);  \
+        B = MAX(A, B);           \
+        A = min_;                \
+    }
+
+static void T(median3_pixel)(const PIXEL *lines[3], PIXEL *dst, int col, int width)
+{
+    PIXEL p[9];
+    for (int k = 0; k < 3; ++k)
+        for (int l = 0; l < 3; ++l)
+            p[3 * k + l] = lines[k][RANK_CLAMP(col + l - 1, width)];
+    MEDIAN9_NETWORK(p, RANK_SORT);
+    dst[col] = p[4];
+}
+
+static void T(median3_band)(struct image *img, struct image *out, int row_begin, int row_end)
+{
+    int height = img->height;
+    int width = img->width;
+    median9_row_t median9_row = median9_row_select(img->maxval);
+
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        const PIXEL *lines[3];
+        for (int k = 0; k < 3; ++k)
+            lines[k] = ROW(img, RANK_CLAMP(row + k - 1, height));
+        PIXEL *dst = ROW(out, row);
+
+        /* The vectorized medians cover the interior columns from 1, the rest is scalar */
+        int begin = 1;
+        if (median9_row != NULL && width > 2)
+        {
+            const void *rows[3] = {lines[0], lines[1], lines[2]};
+            begin += median9_row(rows, dst + 1, width - 2);
+        }
+
+        T(median3_pixel)(lines, dst, 0, width);
+        for (int col = begin; col < width; ++col)
+            T(median3_pixel)(lines, dst, col, width);
+    }
+}
+
+/*
+ * Larger medians keep a histogram of the window, which slides along the row :
+ * one column of size pixels leaves it and one enters it for each pixel. The
+ * median and the number of pixels below it are updated as the pixels move
+ * (T. Huang, "A fast two-dimensional median filtering algorithm").
+ *
+ * A cursor over the 65536 levels of 16-bit pixels could take thousands of
+ * steps per pixel, so they also get a coarse histogram of 256 bins of 256
+ * levels (S. Perreault, P. Hebert, "Median filtering in constant time") : the
+ * cursor moves over the coarse bins, then the median is searched within its
+ * coarse bin, at most 256 + 256 steps. 8-bit pixels have one level per coarse
+ * bin, and only the coarse histogram.
+ */
+#define MEDIAN_COARSE_SHIFT (sizeof(PIXEL) > 1 ? 8 : 0)
+
+static void T(median_hist_band)(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    int height = img->height;
+    int width = img->width;
+    int radius = size / 2;
+    int half = size * size / 2;
+    const int shift = MEDIAN_COARSE_SHIFT;
+
+    int *coarse = (int *)calloc(((size_t)img->maxval >> shift) + 1, sizeof(int));
+    int *fine = shift > 0 ? (int *)calloc((size_t)img->maxval + 1, sizeof(int)) : coarse;
+    const PIXEL **lines = (const PIXEL **)malloc(sizeof(PIXEL *) * size);
+    if (coarse == NULL || fine == NULL || lines == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the median histogram\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        for (int k = 0; k < size; ++k)
+            lines[k] = ROW(img, RANK_CLAMP(row + k - radius, height));
+
+        for (int l = -radius; l <= radius; ++l)
+        {
+            for (int k = 0; k < size; ++k)
+            {
+                PIXEL v = lines[k][RANK_CLAMP(l, width)];
+                ++coarse[v >> shift];
+                if (shift > 0)
+                    ++fine[v];
+            }
+        }
+
+        int bin = 0;   /* coarse bin of the median */
+        int below = 0; /* pixels in the coarse bins below it */
+        PIXEL *dst = ROW(out, row);
+        for (int col = 0; col < width; ++col)
+        {
+            if (col > 0)
+            {
+                int leaving = RANK_CLAMP(col - radius - 1, width);
+                int entering = RANK_CLAMP(col + radius, width);
+                for (int k = 0; k < size; ++k)
+                {
+                    PIXEL v = lines[k][leaving];
+                    --coarse[v >> shift];
+                    below -= (v >> shift) < bin;
+                    if (shift > 0)
+                        --fine[v];
+                    v = lines[k][entering];
+                    ++coarse[v >> shift];
+                    below += (v >> shift) < bin;
+                    if (shift > 0)
+                        ++fine[v];
+                }
+            }
+
+            /* The median is the smallest value with more than half of the window at or below it */
+            while (below > half)
+                below -= coarse[--bin];
+            while (below + coarse[bin] <= half)
+                below += coarse[bin++];
+
+            int median = bin << shift;
+            for (int count = below; count + fine[median] <= half; ++median)
+                count += fine[median];
+            dst[col] = median;
+        }
+
+        for (int l = width - 1 - radius; l <= width - 1 + radius; ++l)
+        {
+            for (int k = 0; k < size; ++k)
+            {
+                PIXEL v = lines[k][RANK_CLAMP(l, width)];
+                --coarse[v >> shift];
+                if (shift > 0)
+                    --fine[v];
+            }
+        }
+    }
+
+    if (shift > 0)
+        free(fine);
+    free(coarse);
+    free(lines);
+}
+
+void T(median_band)(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    if (size == 3)
+        T(median3_band)(img, out, row_begin, row_end);
+    else
+        T(median_hist_band)(img, size, out, row_begin, row_end);
+}
+
+/*
+ * Erosion (minimum) or dilation (maximum) over a size x size square : the
+ * square is separable, a vertical pass over size rows then a horizontal pass
+ * over size columns.
+ */
+void T(morphology_band)(struct image *img, int size, struct image *out, int row_begin, int row_end,
+                        int dilate)
+{
+    int height = img->height;
+    int width = img->width;
+    int radius = size / 2;
+
+    PIXEL *acc = (PIXEL *)malloc(sizeof(PIXEL) * width);
+    if (acc == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the morphology row buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        memcpy(acc, ROW(img, RANK_CLAMP(row - radius, height)), sizeof(PIXEL) * width);
+        for (int k = 1; k < size; ++k)
+        {
+            const PIXEL *line = ROW(img, RANK_CLAMP(row + k - radius, height));
+            if (dilate)
+                for (int col = 0; col < width; ++col)
+                    acc[col] = MAX(acc[col], line[col]);
+            else
+                for (int col = 0; col < width; ++col)
+                    acc[col] = MIN(acc[col], line[col]);
+        }
+
+        PIXEL *dst = ROW(out, row);
+        for (int col = 0; col < width; ++col)
+        {
+            PIXEL v = acc[col];
+            int end = MIN(col + radius, width - 1);
+            if (dilate)
+                for (int l = MAX(col - radius, 0); l <= end; ++l)
+                    v = MAX(v, acc[l]);
+            else
+                for (int l = MAX(col - radius, 0); l <= end; ++l)
+                    v = MIN(v, acc[l]);
+            dst[col] = v;
+        }
+    }
+
+    free(acc);
+}
+
+/*
+ * Summed-area table filters : rows [first, first + height) of img are summed
+ * into self, see integral_build(). The window is clipped to the image, the
+ * mean and the deviation are the ones of the pixels inside it. box_blur
+ * divides by the whole window instead : the pixels outside count as 0, like in
+ * convolve().
+ */
+static void T(integral_rows)(struct image *img, struct integral_image *self, int i_begin, int i_end)
+{
+    for (int i = i_begin; i < i_end; ++i)
+    {
+        const PIXEL *src = ROW(img, self->first + i);
+        uint64_t *sum = self->sum + (size_t)(i + 1) * self->stride;
+        uint64_t *sqsum = self->sqsum + (size_t)(i + 1) * self->stride;
+        sum[0] = sqsum[0] = 0;
+        for (int col = 0; col < self->width; ++col)
+        {
+            uint64_t p = src[col];
+            sum[col + 1] = sum[col] + p;
+            sqsum[col + 1] = sqsum[col] + p * p;
+        }
+    }
+}
+
+static void T(integral_band)(struct image *img, int size, struct image *out, int row_begin, int row_end,
+                             int mode)
+{
+    int height = img->height;
+    int width = img->width;
+    int radius = size / 2;
+    int block = MAX(INTEGRAL_BLOCK_ROWS, size);
+
+    struct integral_image sat;
+    if (integral_alloc(&sat, MIN(block + 2 * radius, height), width) != 0)
+    {
+        fprintf(stderr, "Unable to allocate the summed-area table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int block_begin = row_begin; block_begin < row_end; block_begin += block)
+    {
+        int block_end = MIN(block_begin + block, row_end);
+        int first = MAX(block_begin - radius, 0);
+        integral_build(&sat, img, first, MIN(block_end + radius, height) - first);
+
+        for (int row = block_begin; row < block_end; ++row)
+        {
+            size_t top = (size_t)(MAX(row - radius, 0) - first) * sat.stride;
+            size_t bottom = (size_t)(MIN(row + radius + 1, height) - first) * sat.stride;
+            int nrows = (int)((bottom - top) / sat.stride);
+            const PIXEL *src = ROW(img, row);
+            PIXEL *dst = ROW(out, row);
+
+            for (int col = 0; col < width; ++col)
+            {
+                int left = MAX(col - radius, 0);
+                int right = MIN(col + radius + 1, width);
+                int count = nrows * (right - left);
+                uint64_t sum = sat.sum[bottom + right] - sat.sum[bottom + left] -
+                               sat.sum[top + right] + sat.sum[top + left];
+                if (mode == INTEGRAL_BOX)
+                {
+                    dst[col] = sum / ((uint64_t)size * size);
+                    continue;
+                }
+                if (mode == INTEGRAL_MEAN)
+                {
+                    dst[col] = sum / count;
+                    continue;
+                }
+                uint64_t sqsum = sat.sqsum[bottom + right] - sat.sqsum[bottom + left] -
+                                 sat.sqsum[top + right] + sat.sqsum[top + left];
+                dst[col] = local_threshold(src[col], sum, sqsum, count, out->maxval);
+            }
+        }
+    }
+
+    integral_free(&sat);
+}
+
+void T(mean_band)(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    T(integral_band)(img, size, out, row_begin, row_end, INTEGRAL_MEAN);
+}
+
+void T(threshold_band)(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    T(integral_band)(img, size, out, row_begin, row_end, INTEGRAL_THRESHOLD);
+}
+
+void T(box_blur_band)(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    T(integral_band)(img, size, out, row_begin, row_end, INTEGRAL_BOX);
+}
+
+/* Adds the pixels of the rows [row_begin, row_end) to hist, which has maxval + 1 bins */
+static void T(histogram_rows)(struct image *img, int row_begin, int row_end, uint64_t *hist)
+{
+    int width = img->width;
+
+    if (sizeof(PIXEL) > 1)
+    {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const PIXEL *src = ROW(img, row);
+            for (int col = 0; col < width; ++col)
+                ++hist[src[col]];
+        }
+        return;
+    }
+
+    /*
+     * Consecutive pixels go to 4 sets of counters, so that a run of equal
+     * pixels does not wait on the increment of the same counter. The 32-bit
+     * counters are added to hist before they can overflow.
+     */
+    uint32_t counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    size_t pending = 0;
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        const PIXEL *src = ROW(img, row);
+        int col = 0;
+        for (; col + 4 <= width; col += 4)
+        {
+            ++counts[0][src[col]];
+            ++counts[1][src[col + 1]];
+            ++counts[2][src[col + 2]];
+            ++counts[3][src[col + 3]];
+        }
+        for (; col < width; ++col)
+            ++counts[0][src[col]];
+
+        pending += width;
+        if (pending > UINT32_MAX - (size_t)width || row == row_end - 1)
+        {
+            for (int v = 0; v < 256; ++v)
+                hist[v] += (uint64_t)counts[0][v] + counts[1][v] + counts[2][v] + counts[3][v];
+            memset(counts, 0, sizeof(counts));
+            pending = 0;
+        }
+    }
+}
+
+/* out = lut[img] over the rows [row_begin, row_end); img and out can be the same image */
+static void T(lut_band)(struct image *img, const int *lut, struct image *out, int row_begin, int row_end)
+{
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        const PIXEL *src = ROW(img, row);
+        PIXEL *dst = ROW(out, row);
+        for (int col = 0; col < img->width; ++col)
+            dst[col] = lut[src[col]];
+    }
+}
+
+#undef MEDIAN_COARSE_SHIFT
+#undef RANK_SORT
+#undef RANK_CLAMP
+#undef ROW
+#undef T
+#undef PIXEL_CONCAT
+#undef PIXEL_CONCAT2
+#undef PIXEL_SUFFIX
+#undef PIXEL
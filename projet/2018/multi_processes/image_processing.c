@@ -1,18 +1,82 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <aio.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 struct image
 {
     int height;
     int width;
-    unsigned char **raster;
+    int maxval; /* 255 for 8-bit images, up to 65535 for 16-bit images */
+    unsigned char **raster; /* rows of unsigned char, or of unsigned short if maxval > 255 */
+    void *map; /* mapping holding the pixels (a file or a large raster), NULL if they are calloc'ed */
+    size_t map_length;
 };
 
+/*
+ * Large rasters are mapped on huge page boundaries and advised to use
+ * transparent huge pages, or explicit ones with raster_hugetlb (when the
+ * system has reserved some). The kernel zero-fills their pages when they are
+ * first touched, so nothing writes them before the pixels themselves : the
+ * first touch is the fread() of the input, or the filter writing the output,
+ * which also places the pages on the NUMA node of the thread doing it.
+ */
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+int raster_hugetlb = 0;
+
+/* Maps at least length bytes of anonymous memory, flags is MAP_PRIVATE or MAP_SHARED; returns NULL on failure */
+void *raster_map(size_t length, int flags, size_t *map_length)
+{
+    if (length < HUGE_PAGE_SIZE)
+    {
+        void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS, -1, 0);
+        *map_length = length;
+        return map == MAP_FAILED ? NULL : map;
+    }
+
+    length = (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    *map_length = length;
+    if (raster_hugetlb)
+    {
+        void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED)
+            return map;
+    }
+
+    /* One more huge page than needed, the unaligned ends are unmapped */
+    size_t padded = length + HUGE_PAGE_SIZE;
+    char *map = (char *)mmap(NULL, padded, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((size_t)map + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > map)
+        munmap(map, aligned - map);
+    munmap(aligned + length, map + padded - (aligned + length));
+    madvise(aligned, length, MADV_HUGEPAGE);
+    return aligned;
+}
+
 unsigned char **
 raster_alloc(int height, int width)
 {
@@ -20,12 +84,12 @@ raster_alloc(int height, int width)
     if (raster == NULL)
         return NULL;
 
-    raster[0] = (unsigned char *)calloc(height * width, sizeof(unsigned char));
+    raster[0] = (unsigned char *)calloc((size_t)height * width, sizeof(unsigned char));
     if (raster[0] == NULL)
         return NULL;
 
     for (int i = 1; i < height; ++i)
-        raster[i] = raster[0] + i * width;
+        raster[i] = raster[0] + (size_t)i * width;
 
     return raster;
 }
@@ -40,12 +104,18 @@ void raster_free(unsigned char **raster)
 
 void image_free(struct image *self)
 {
-    raster_free(self->raster);
+    if (self->map != NULL)
+    {
+        munmap(self->map, self->map_length);
+        free(self->raster);
+    }
+    else
+        raster_free(self->raster);
     free(self);
 }
 
 struct image *
-image_alloc(int height, int width)
+image_alloc_maxval(int height, int width, int maxval)
 {
     struct image *self = (struct image *)calloc(1, sizeof(struct image));
     if (self == NULL)
@@ -53,74 +123,190 @@ image_alloc(int height, int width)
 
     self->height = height;
     self->width = width;
+    self->maxval = maxval;
 
-    self->raster = raster_alloc(height, width);
+    size_t row_bytes = (size_t)width * (maxval > 255 ? 2 : 1);
+    if ((size_t)height * row_bytes < HUGE_PAGE_SIZE)
+        self->raster = raster_alloc(height, row_bytes);
+    else
+    {
+        self->map = raster_map((size_t)height * row_bytes, MAP_PRIVATE, &self->map_length);
+        self->raster = (unsigned char **)calloc(height, sizeof(unsigned char *));
+        for (int i = 0; i < height && self->map != NULL && self->raster != NULL; ++i)
+            self->raster[i] = (unsigned char *)self->map + (size_t)i * row_bytes;
+        if (self->map == NULL)
+        {
+            free(self->raster);
+            self->raster = NULL;
+        }
+    }
 
     if (self->raster == NULL)
+    {
         image_free(self);
+        return NULL;
+    }
 
     return self;
 }
 
 struct image *
-pgm_parse(FILE *fp)
+image_alloc(int height, int width)
+{
+    return image_alloc_maxval(height, width, 255);
+}
+
+size_t image_row_bytes(struct image *img)
+{
+    return (size_t)img->width * (img->maxval > 255 ? 2 : 1);
+}
+
+/* Pixel p of the raster, counted from the first pixel of the first row */
+int pixel_get(struct image *img, size_t p)
+{
+    if (img->maxval > 255)
+        return ((unsigned short *)img->raster[0])[p];
+    return img->raster[0][p];
+}
+
+void pixel_set(struct image *img, size_t p, int value)
+{
+    if (img->maxval > 255)
+        ((unsigned short *)img->raster[0])[p] = value;
+    else
+        img->raster[0][p] = value;
+}
+
+/* Reads the header up to the raster; returns 0 on success */
+/* P5 (grey) and P6 (colour) headers, the magic number is 5 or 6 */
+int pnm_parse_header(FILE *fp, int *magic, int *height, int *width, int *maxval)
 {
     /* Check the file format */
     {
-        int magic_number = 0;
-        int match = fscanf(fp, "P%d\n", &magic_number);
+        int match = fscanf(fp, "P%d\n", magic);
         if (match != 1)
         {
             fprintf(stderr, "Parsing failed : magic number expected\n");
-            return NULL;
+            return -1;
         }
-        if (magic_number != 5)
+        if (*magic != 5 && *magic != 6)
         {
-            fprintf(stderr, "Parsing failed : magic number 5 expected, "
+            fprintf(stderr, "Parsing failed : magic number 5 or 6 expected, "
                             "got %d instead\n",
-                    magic_number);
-            return NULL;
+                    *magic);
+            return -1;
         }
     }
 
-    int width, height;
     {
-        int match = fscanf(fp, "%d %d\n", &width, &height);
+        int match = fscanf(fp, "%d %d\n", width, height);
         if (match != 2)
         {
             fprintf(stderr, "Parsing failed : width and height expected\n");
-            return NULL;
+            return -1;
         }
     }
 
-    /* Check maximum gray value - only the single byte version is implemented */
+    /* Check maximum gray value - one byte per pixel up to 255, two bytes up to 65535 */
     {
-        int maxval = 0;
-        int match = fscanf(fp, "%d\n", &maxval);
+        int match = fscanf(fp, "%d", maxval);
         if (match != 1)
         {
             fprintf(stderr, "Parsing failed : maximum gray value expected\n");
-            return NULL;
+            return -1;
         }
 
-        if (maxval > 255)
+        /* A single whitespace : the first pixels may have whitespace values */
+        if (!isspace(fgetc(fp)))
+        {
+            fprintf(stderr, "Parsing failed : whitespace expected after the header\n");
+            return -1;
+        }
+
+        if (*maxval < 1 || *maxval > 65535)
         {
             fprintf(stderr,
-                    "Parsing failed : maximum gray value < 255 is expected, "
+                    "Parsing failed : maximum gray value <= 65535 is expected, "
                     "got %d instead\n",
-                    maxval);
-            return NULL;
+                    *maxval);
+            return -1;
         }
     }
 
-    struct image *img = image_alloc(height, width);
+    return 0;
+}
+
+int pgm_parse_header(FILE *fp, int *height, int *width, int *maxval)
+{
+    int magic;
+    if (pnm_parse_header(fp, &magic, height, width, maxval) != 0)
+        return -1;
+    if (magic != 5)
+    {
+        fprintf(stderr, "Parsing failed : magic number 5 expected, "
+                        "got %d instead\n",
+                magic);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 16-bit samples are big-endian in PGM files. This converts them from the
+ * file order to the host order, or back : the operation is the same both ways.
+ */
+void pgm_swap16(void *data, size_t nsamples)
+{
+    unsigned char *bytes = (unsigned char *)data;
+    for (size_t i = 0; i < nsamples; ++i)
+    {
+        unsigned short value = (unsigned short)(bytes[2 * i] << 8 | bytes[2 * i + 1]);
+        memcpy(bytes + 2 * i, &value, sizeof(value));
+    }
+}
+
+/*
+ * Nothing checks the samples of a file against its maxval : they are clamped
+ * to it, since the histograms and the lookup tables have maxval + 1 entries.
+ */
+void pgm_clamp16(unsigned short *samples, size_t nsamples, int maxval)
+{
+    for (size_t i = 0; i < nsamples; ++i)
+        if (samples[i] > maxval)
+            samples[i] = (unsigned short)maxval;
+}
+
+/* pgm_swap16() from the file order, then pgm_clamp16() in the same pass */
+void pgm_load16(void *data, size_t nsamples, int maxval)
+{
+    unsigned char *bytes = (unsigned char *)data;
+    for (size_t i = 0; i < nsamples; ++i)
+    {
+        unsigned short value = (unsigned short)(bytes[2 * i] << 8 | bytes[2 * i + 1]);
+        if (value > maxval)
+            value = (unsigned short)maxval;
+        memcpy(bytes + 2 * i, &value, sizeof(value));
+    }
+}
+
+struct image *
+pgm_parse(FILE *fp)
+{
+    int width, height, maxval;
+    if (pgm_parse_header(fp, &height, &width, &maxval) != 0)
+        return NULL;
+
+    /* 8-bit images are always written back with a maximum gray value of 255 */
+    struct image *img = image_alloc_maxval(height, width, maxval > 255 ? maxval : 255);
     if (img == NULL)
     {
         fprintf(stderr, "Unable to allocate image struct\n");
         return NULL;
     }
 
-    fread(img->raster[0], sizeof(unsigned char), height * width, fp);
+    fread(img->raster[0], image_row_bytes(img), height, fp);
+    if (img->maxval > 255)
+        pgm_load16(img->raster[0], (size_t)height * width, maxval);
 
     return img;
 }
@@ -129,17 +315,210 @@ void pgm_write_header(struct image *img, FILE *fp)
 {
     fprintf(fp, "P5\n");
     fprintf(fp, "%d %d\n", img->width, img->height);
-    fprintf(fp, "255\n");
+    fprintf(fp, "%d\n", img->maxval);
 }
 
 void pgm_write_raster(struct image *img, FILE *fp)
 {
-    fwrite(img->raster[0], sizeof(unsigned char), img->height * img->width, fp);
+    if (img->maxval <= 255)
+    {
+        fwrite(img->raster[0], sizeof(unsigned char), (size_t)img->height * img->width, fp);
+        return;
+    }
+
+    unsigned char *row = (unsigned char *)malloc(image_row_bytes(img));
+    for (int i = 0; i < img->height && row != NULL; ++i)
+    {
+        memcpy(row, img->raster[i], image_row_bytes(img));
+        pgm_swap16(row, img->width);
+        fwrite(row, image_row_bytes(img), 1, fp);
+    }
+    free(row);
 }
 
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 
+/*
+ * Memory-mapped images
+ *
+ * pgm_map() maps the input file and points the raster straight into the
+ * mapping, after the header : no buffer is allocated and nothing is copied.
+ * pgm_create() sizes the output file with ftruncate() and maps it shared, so
+ * the filters write their pixels directly into the page cache. In both cases
+ * image_free() unmaps the file.
+ */
+
+/* Parse "P5 width height maxval" followed by a single whitespace; returns the raster offset */
+static long pgm_parse_header_mapped(const unsigned char *data, size_t length, int *width, int *height,
+                                    int *maxval)
+{
+    if (length < 2 || data[0] != 'P' || data[1] != '5')
+    {
+        fprintf(stderr, "Parsing failed : magic number 5 expected\n");
+        return -1;
+    }
+
+    const char *names[] = {"width", "height", "maximum gray value"};
+    int values[3];
+    size_t pos = 2;
+    for (int i = 0; i < 3; ++i)
+    {
+        while (pos < length && isspace(data[pos]))
+            ++pos;
+        if (pos == length || !isdigit(data[pos]))
+        {
+            fprintf(stderr, "Parsing failed : %s expected\n", names[i]);
+            return -1;
+        }
+
+        long value = 0;
+        while (pos < length && isdigit(data[pos]) && value <= INT_MAX)
+            value = value * 10 + (data[pos++] - '0');
+        if (value > INT_MAX)
+        {
+            fprintf(stderr, "Parsing failed : %s out of range\n", names[i]);
+            return -1;
+        }
+        values[i] = (int)value;
+    }
+
+    if (pos == length || !isspace(data[pos]))
+    {
+        fprintf(stderr, "Parsing failed : whitespace expected after the header\n");
+        return -1;
+    }
+
+    if (values[2] < 1 || values[2] > 65535)
+    {
+        fprintf(stderr,
+                "Parsing failed : maximum gray value <= 65535 is expected, "
+                "got %d instead\n",
+                values[2]);
+        return -1;
+    }
+
+    *width = values[0];
+    *height = values[1];
+    *maxval = values[2];
+    return pos + 1;
+}
+
+static struct image *
+image_map(void *map, size_t map_length, long offset, int height, int width)
+{
+    struct image *self = (struct image *)calloc(1, sizeof(struct image));
+    if (self == NULL)
+        return NULL;
+
+    self->height = height;
+    self->width = width;
+    self->maxval = 255;
+    self->map = map;
+    self->map_length = map_length;
+
+    self->raster = (unsigned char **)calloc(MAX(height, 1), sizeof(unsigned char *));
+    if (self->raster == NULL)
+    {
+        image_free(self);
+        return NULL;
+    }
+
+    for (int i = 0; i < height; ++i)
+        self->raster[i] = (unsigned char *)map + offset + (size_t)i * width;
+
+    return self;
+}
+
+/*
+ * Returns NULL if filename cannot be mapped (a pipe for instance), with errno
+ * set to EINVAL if it is not a valid PGM file. 16-bit images are not mapped :
+ * their big-endian samples are converted by pgm_parse().
+ */
+struct image *
+pgm_map(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    int width, height, maxval;
+    long offset = pgm_parse_header_mapped((const unsigned char *)map, st.st_size, &width, &height, &maxval);
+    if (offset >= 0 && maxval > 255)
+    {
+        munmap(map, st.st_size);
+        errno = ENOTSUP;
+        return NULL;
+    }
+    if (offset >= 0 && (size_t)st.st_size - offset < (size_t)height * width)
+    {
+        fprintf(stderr, "Parsing failed : the raster is truncated\n");
+        offset = -1;
+    }
+    if (offset < 0)
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct image *img = image_map(map, st.st_size, offset, height, width);
+    if (img == NULL)
+        munmap(map, st.st_size);
+    return img;
+}
+
+/* 8-bit only; returns NULL if filename cannot be sized and mapped (a pipe or a terminal for instance) */
+struct image *
+pgm_create(const char *filename, int height, int width)
+{
+    char header[64];
+    int offset = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", width, height);
+    size_t length = offset + (size_t)height * width;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return NULL;
+
+    if (ftruncate(fd, length) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    memcpy(map, header, offset);
+
+    struct image *img = image_map(map, length, offset, height, width);
+    if (img == NULL)
+        munmap(map, length);
+    return img;
+}
+
+/* 1 if both paths name the same existing file */
+int same_file(const char *a, const char *b)
+{
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
 int sum_over_kernel(struct image *img, int row, int col, double kernel[3][3])
 {
     double sum = 0;
@@ -181,76 +560,2912 @@ void convolve(struct image *img, kernel_t *kernels[2], struct image *out)
     }
 }
 
-int main(int argc, char *argv[])
+/*
+ * Tiled convolution engine
+ *
+ * convolve() checks the image bounds for every tap of every pixel. Here, the
+ * output is produced tile by tile : a tile is a block of rows whose source rows
+ * fit in the cache, restricted to a range of columns. Pixels that are at least
+ * one pixel away from the image border are computed without any bounds check;
+ * only the one pixel wide border strips go through sum_over_kernel().
+ *
+ * The taps are accumulated in the same order as sum_over_kernel() so that the
+ * output is byte-identical to the one of convolve().
+ */
+
+#define TILE_CACHE_SIZE (256 * 1024)
+#define TILE_WIDTH 4096
+
+#include "convolve_simd.h"
+
+#define ORIENTATION_NBINS 4
+
+/*
+ * Direction of the gradient (x, y) modulo 180 degrees, in ORIENTATION_NBINS
+ * bins : 0 around the x axis, 2 around the y axis, 1 and 3 on the diagonals
+ * where x and y have the same and opposite signs. A zero gradient is in bin 0.
+ */
+static unsigned char gradient_direction(double x, double y)
+{
+    double ax = fabs(x);
+    double ay = fabs(y);
+    if (ay <= ax * 0.41421356) /* tan(22.5 degrees) */
+        return 0;
+    if (ay >= ax * 2.41421356) /* tan(67.5 degrees) */
+        return 2;
+    return (x > 0) == (y > 0) ? 1 : 3;
+}
+
+/*
+ * Separable kernels
+ *
+ * A kernel is separable when it is the outer product of a vertical vector v
+ * and a horizontal vector h. It is then applied as a horizontal pass over each
+ * source row, followed by a vertical pass over the filtered rows : 2 * size
+ * taps per pixel instead of size * size. The filtered rows are kept in a ring
+ * of size rows, reused from one output row to the next, so that each source
+ * row goes through the horizontal pass once.
+ *
+ * 3x3 kernels are detected automatically, but only when both vectors are
+ * made of small dyadic values (gaussian_blur, identity) : the sums are then
+ * exact and the output is identical to the one of convolve(). Larger kernels
+ * are declared by the caller (see gaussian_blur_separable()).
+ */
+
+#define SEPARABLE_MAX_SIZE 63
+
+struct separable_kernel
+{
+    int size; /* odd */
+    double h[SEPARABLE_MAX_SIZE];
+    double v[SEPARABLE_MAX_SIZE];
+};
+
+static int is_dyadic(double x)
+{
+    double w = ldexp(x, QKERNEL_MAX_SHIFT);
+    return w == (long)w && fabs(x) < 32768;
+}
+
+/* Returns 0 if kernel is exactly the product of two dyadic vectors */
+int separable_init(struct separable_kernel *self, double kernel[3][3])
 {
+    int pk = 0;
+    int pl = 0;
+    for (int k = 0; k < 3; ++k)
+        for (int l = 0; l < 3; ++l)
+            if (fabs(kernel[k][l]) > fabs(kernel[pk][pl]))
+            {
+                pk = k;
+                pl = l;
+            }
+    if (kernel[pk][pl] == 0)
+        return -1;
 
-    if (argc != 3)
+    self->size = 3;
+    for (int i = 0; i < 3; ++i)
     {
-        fprintf(stderr, "Usage: %s filename1 filename2\n", argv[0]);
-        return EXIT_FAILURE;
+        self->v[i] = kernel[i][pl] / kernel[pk][pl];
+        self->h[i] = kernel[pk][i];
+        if (!is_dyadic(self->v[i]) || !is_dyadic(self->h[i]))
+            return -1;
+    }
+
+    for (int k = 0; k < 3; ++k)
+        for (int l = 0; l < 3; ++l)
+            if (self->v[k] * self->h[l] != kernel[k][l])
+                return -1;
+
+    return 0;
+}
+
+/* size x size gaussian blur : binomial coefficients, gaussian_blur for size 3 */
+void gaussian_blur_separable(struct separable_kernel *self, int size)
+{
+    self->size = size;
+    double c = 1;
+    for (int i = 0; i < size; ++i)
+    {
+        self->h[i] = self->v[i] = ldexp(c, -(size - 1));
+        c = c * (size - 1 - i) / (i + 1);
     }
+}
 
-    double edge_detect[3][3] = {{0, 1, 0},
-                                {1, -4, 1},
-                                {0, 1, 0}};
+/*
+ * Threads over a single image
+ *
+ * The summed-area tables and the histograms split their passes between
+ * image_threads threads. The batch mode keeps one per image, its workers
+ * already filter several images at once.
+ */
 
-    double edge_detect2[3][3] = {{-1, -1, -1},
-                                 {-1, 8, -1},
-                                 {-1, -1, -1}};
+#define IMAGE_MAX_THREADS 64
+#define IMAGE_THREAD_PIXELS (64 * 1024) /* fewer pixels per thread are not worth a thread */
 
-    double edge_detect_x[3][3] = {{-1, 0, 1},
-                                  {-2, 0, 2},
-                                  {-1, 0, 1}};
+int image_threads = 1;
 
-    double edge_detect_y[3][3] = {{1, 2, 1},
-                                  {0, 0, 0},
-                                  {-1, -2, -1}};
+/* Number of threads for a pass over npixels, at most limit */
+static int image_nthreads(size_t npixels, int limit)
+{
+    int nthreads = (int)MIN((size_t)image_threads, npixels / IMAGE_THREAD_PIXELS + 1);
+    return MAX(1, MIN(nthreads, MIN(limit, IMAGE_MAX_THREADS)));
+}
 
-    double sharpen[3][3] = {{0, -1, 0},
-                            {-1, 5, -1},
-                            {0, -1, 0}};
+/* Runs fn on each of the ntasks tasks of size bytes, the last one on the calling thread like any that cannot start */
+static void image_run(void *(*fn)(void *), void *tasks, size_t size, int ntasks)
+{
+    pthread_t threads[IMAGE_MAX_THREADS];
+    int started[IMAGE_MAX_THREADS];
+    for (int i = 0; i < ntasks - 1; ++i)
+        started[i] = pthread_create(&threads[i], NULL, fn, (char *)tasks + i * size) == 0;
+    fn((char *)tasks + (ntasks - 1) * size);
+    for (int i = 0; i < ntasks - 1; ++i)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn((char *)tasks + i * size);
+    }
+}
 
-    double box_blur[3][3] = {{1. / 9, 1. / 9, 1. / 9},
-                             {1. / 9, 1. / 9, 1. / 9},
-                             {1. / 9, 1. / 9, 1. / 9}};
+/*
+ * Summed-area tables
+ *
+ * sum[i][j] is the sum of the pixels in the rows [first, first + i) and the
+ * columns [0, j) of an image, sqsum the sum of their squares : the sum over any
+ * rectangle takes four lookups whatever its size (F. Crow, "Summed-area tables
+ * for texture mapping"), so the mean and threshold filters cost the same at any
+ * size. A table is built by a prefix sum along each row, then down each column;
+ * both scans are split between image_threads threads, by rows then by columns.
+ */
 
-    double gaussian_blur[3][3] = {{1. / 16, 2. / 16, 1. / 16},
-                                  {2. / 16, 4. / 16, 2. / 16},
-                                  {1. / 16, 2. / 16, 1. / 16}};
+#define WINDOW_MAX_SIZE 1023
+#define INTEGRAL_BLOCK_ROWS 256
 
-    double identity[3][3] = {{0, 0, 0},
-                             {0, 1, 0},
-                             {0, 0, 0}};
+/* What integral_band() computes over each window */
+#define INTEGRAL_MEAN 0
+#define INTEGRAL_THRESHOLD 1
+#define INTEGRAL_BOX 2
 
-    // kernel_t *kernels[] = {&identity, NULL};
-    // kernel_t *kernels[] = {&box_blur, NULL};
-    kernel_t *kernels[] = {&edge_detect2, NULL};
-    // kernel_t *kernels[] = {&sharpen, NULL};
-    // kernel_t *kernels[] = {&edge_detect_x, &edge_detect_y};
+struct integral_image
+{
+    int first;     /* first image row */
+    int height;    /* number of image rows */
+    int width;
+    size_t stride; /* width + 1 */
+    uint64_t *sum;
+    uint64_t *sqsum;
+};
 
-    FILE *fp = fopen(argv[1], "r");
-    if (fp == NULL)
+int integral_alloc(struct integral_image *self, int height, int width)
+{
+    self->first = 0;
+    self->height = height;
+    self->width = width;
+    self->stride = (size_t)width + 1;
+    self->sum = (uint64_t *)malloc(sizeof(uint64_t) * (height + 1) * self->stride);
+    self->sqsum = (uint64_t *)malloc(sizeof(uint64_t) * (height + 1) * self->stride);
+    if (self->sum == NULL || self->sqsum == NULL)
     {
-        fprintf(stderr, "Unable to open input file : %s\n", argv[1]);
-        return EXIT_FAILURE;
+        free(self->sum);
+        free(self->sqsum);
+        return -1;
     }
+    return 0;
+}
 
-    struct image *img = pgm_parse(fp);
-    fclose(fp);
+void integral_free(struct integral_image *self)
+{
+    free(self->sum);
+    free(self->sqsum);
+}
 
-    struct image *out = image_alloc(img->height, img->width);
-    convolve(img, kernels, out);
+void integral_build(struct integral_image *self, struct image *img, int first, int height);
 
-    fp = fopen(argv[2], "w");
-    if (fp == NULL)
+/*
+ * Sauvola's threshold : mean * (1 + k * (deviation / R - 1)), R being half
+ * of the gray range (J. Sauvola, M. Pietikainen, "Adaptive document image
+ * binarization"). Pixels above it are white, the others black.
+ */
+#define SAUVOLA_K 0.5
+
+static int local_threshold(int pixel, uint64_t sum, uint64_t sqsum, int count, int maxval)
+{
+    double mean = (double)sum / count;
+    double variance = MAX((double)sqsum / count - mean * mean, 0);
+    double threshold = mean * (1 + SAUVOLA_K * (sqrt(variance) / ((maxval + 1) / 2.) - 1));
+    return pixel > threshold ? maxval : 0;
+}
+
+#define PIXEL unsigned char
+#define PIXEL_SUFFIX 8
+#include "convolve_template.h"
+
+#define PIXEL unsigned short
+#define PIXEL_SUFFIX 16
+#include "convolve_template.h"
+
+/* Convolve the rows [row_begin, row_end) of img into the same rows of out */
+void convolve_band(struct image *img, kernel_t *kernels[2], struct image *out,
+                   int row_begin, int row_end)
+{
+    if (img->maxval > 255)
+        convolve_band_16(img, kernels, out, row_begin, row_end);
+    else
+        convolve_band_8(img, kernels, out, row_begin, row_end);
+}
+
+void convolve_separable_band(struct image *img, struct separable_kernel *sep, struct image *out,
+                             int row_begin, int row_end)
+{
+    if (img->maxval > 255)
+        convolve_separable_band_16(img, sep, out, row_begin, row_end);
+    else
+        convolve_separable_band_8(img, sep, out, row_begin, row_end);
+}
+
+/* orient is an 8-bit image with a maximum gray value of ORIENTATION_NBINS - 1 */
+void gradient_orientation(struct image *img, kernel_t *kernels[2], struct image *orient)
+{
+    if (img->maxval > 255)
+        gradient_orientation_band_16(img, kernels, orient, 0, img->height);
+    else
+        gradient_orientation_band_8(img, kernels, orient, 0, img->height);
+}
+
+void median_band(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    if (img->maxval > 255)
+        median_band_16(img, size, out, row_begin, row_end);
+    else
+        median_band_8(img, size, out, row_begin, row_end);
+}
+
+void erode_band(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    if (img->maxval > 255)
+        morphology_band_16(img, size, out, row_begin, row_end, 0);
+    else
+        morphology_band_8(img, size, out, row_begin, row_end, 0);
+}
+
+void dilate_band(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    if (img->maxval > 255)
+        morphology_band_16(img, size, out, row_begin, row_end, 1);
+    else
+        morphology_band_8(img, size, out, row_begin, row_end, 1);
+}
+
+/* Column scan of the table columns [col_begin, col_end), once every row is scanned */
+static void integral_columns(struct integral_image *self, int col_begin, int col_end)
+{
+    for (int i = 1; i <= self->height; ++i)
     {
-        fprintf(stderr, "Unable to open output file : %s\n", argv[2]);
-        return EXIT_FAILURE;
+        uint64_t *sum = self->sum + (size_t)i * self->stride;
+        uint64_t *sqsum = self->sqsum + (size_t)i * self->stride;
+        for (int j = col_begin; j < col_end; ++j)
+        {
+            sum[j] += sum[j - self->stride];
+            sqsum[j] += sqsum[j - self->stride];
+        }
     }
+}
 
-    pgm_write_header(out, fp);
-    pgm_write_raster(out, fp);
-    fclose(fp);
+struct integral_task
+{
+    struct integral_image *table;
+    struct image *img;
+    int begin;
+    int end;
+    int columns; /* 0 : the rows [begin, end), 1 : the columns [begin, end) */
+};
+
+static void *integral_task_run(void *arg)
+{
+    struct integral_task *self = (struct integral_task *)arg;
+    if (self->columns)
+        integral_columns(self->table, self->begin, self->end);
+    else if (self->img->maxval > 255)
+        integral_rows_16(self->img, self->table, self->begin, self->end);
+    else
+        integral_rows_8(self->img, self->table, self->begin, self->end);
+    return NULL;
+}
+
+/* Fills self, allocated for at least height rows of the width of img, with the rows [first, first + height) */
+void integral_build(struct integral_image *self, struct image *img, int first, int height)
+{
+    self->first = first;
+    self->height = height;
+
+    int nthreads = image_nthreads((size_t)height * self->width, MIN(height, self->width));
+
+    struct integral_task tasks[IMAGE_MAX_THREADS];
+    for (int i = 0; i < nthreads; ++i)
+        tasks[i] = (struct integral_task){self, img, (int)((long)i * height / nthreads),
+                                          (int)((long)(i + 1) * height / nthreads), 0};
+    image_run(integral_task_run, tasks, sizeof(tasks[0]), nthreads);
+
+    memset(self->sum, 0, sizeof(uint64_t) * self->stride);
+    memset(self->sqsum, 0, sizeof(uint64_t) * self->stride);
+    for (int i = 0; i < nthreads; ++i)
+        tasks[i] = (struct integral_task){self, img, (int)(1 + (long)i * self->width / nthreads),
+                                          (int)(1 + (long)(i + 1) * self->width / nthreads), 1};
+    image_run(integral_task_run, tasks, sizeof(tasks[0]), nthreads);
+}
+
+void mean_band(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    if (img->maxval > 255)
+        mean_band_16(img, size, out, row_begin, row_end);
+    else
+        mean_band_8(img, size, out, row_begin, row_end);
+}
+
+void threshold_band(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    if (img->maxval > 255)
+        threshold_band_16(img, size, out, row_begin, row_end);
+    else
+        threshold_band_8(img, size, out, row_begin, row_end);
+}
+
+/* size x size box blur, sizes above 3 : four lookups per pixel instead of 2 * size taps */
+void box_blur_band(struct image *img, int size, struct image *out, int row_begin, int row_end)
+{
+    if (img->maxval > 255)
+        box_blur_band_16(img, size, out, row_begin, row_end);
+    else
+        box_blur_band_8(img, size, out, row_begin, row_end);
+}
+
+/*
+ * Histograms
+ *
+ * Each thread counts a band of rows in its own histogram, and the histograms
+ * are summed once every band is counted : no counter is shared while the
+ * pixels are read. The histogram filters turn the histogram of their whole
+ * input into a table of output levels, applied to every pixel.
+ */
+
+struct histogram_task
+{
+    struct image *img;
+    int row_begin;
+    int row_end;
+    uint64_t *hist;
+};
+
+static void *histogram_task_run(void *arg)
+{
+    struct histogram_task *self = (struct histogram_task *)arg;
+    if (self->img->maxval > 255)
+        histogram_rows_16(self->img, self->row_begin, self->row_end, self->hist);
+    else
+        histogram_rows_8(self->img, self->row_begin, self->row_end, self->hist);
+    return NULL;
+}
+
+/* Fills hist, which has img->maxval + 1 bins; returns -1 if the private histograms cannot be allocated */
+int histogram(struct image *img, uint64_t *hist)
+{
+    size_t nbins = (size_t)img->maxval + 1;
+    int nthreads = image_nthreads((size_t)img->height * img->width, img->height);
+    uint64_t *private = (uint64_t *)calloc(nbins * nthreads, sizeof(uint64_t));
+    if (private == NULL)
+        return -1;
+
+    struct histogram_task tasks[IMAGE_MAX_THREADS];
+    for (int i = 0; i < nthreads; ++i)
+        tasks[i] = (struct histogram_task){img, (int)((long)i * img->height / nthreads),
+                                           (int)((long)(i + 1) * img->height / nthreads),
+                                           private + i * nbins};
+    image_run(histogram_task_run, tasks, sizeof(tasks[0]), nthreads);
+
+    memcpy(hist, private, sizeof(uint64_t) * nbins);
+    for (int i = 1; i < nthreads; ++i)
+        for (size_t v = 0; v < nbins; ++v)
+            hist[v] += private[i * nbins + v];
+
+    free(private);
+    return 0;
+}
+
+/* Histogram equalization : the levels follow the cumulative histogram, from its first non-empty bin */
+void equalize_levels(const uint64_t *hist, int maxval, int *lut)
+{
+    uint64_t total = 0;
+    for (int v = 0; v <= maxval; ++v)
+        total += hist[v];
+
+    uint64_t first = 0;
+    for (int v = 0; v <= maxval && first == 0; ++v)
+        first = hist[v];
+
+    uint64_t cumulated = 0;
+    for (int v = 0; v <= maxval; ++v)
+    {
+        cumulated += hist[v];
+        if (total == first)
+            lut[v] = v;
+        else if (cumulated < first)
+            lut[v] = 0;
+        else
+            lut[v] = (int)(((double)(cumulated - first) * maxval) / (total - first) + 0.5);
+    }
+}
+
+#define AUTOLEVELS_CLIP 0.005 /* fraction of the pixels saturated at each end */
+
+/* Auto-levels : the range between the darkest and brightest pixels, clipped, is stretched to [0, maxval] */
+void autolevels_levels(const uint64_t *hist, int maxval, int *lut)
+{
+    uint64_t total = 0;
+    for (int v = 0; v <= maxval; ++v)
+        total += hist[v];
+    uint64_t clip = (uint64_t)(total * AUTOLEVELS_CLIP);
+
+    int low = 0;
+    for (uint64_t below = hist[0]; low < maxval && below <= clip; below += hist[++low])
+        ;
+    int high = maxval;
+    for (uint64_t above = hist[maxval]; high > 0 && above <= clip; above += hist[--high])
+        ;
+
+    for (int v = 0; v <= maxval; ++v)
+    {
+        if (high <= low)
+            lut[v] = v;
+        else
+            lut[v] = MIN(MAX((int)((double)(v - low) * maxval / (high - low) + 0.5), 0), maxval);
+    }
+}
+
+/* Applies levels, built from the histogram of the whole img, to its rows [row_begin, row_end) */
+void levels_band(struct image *img, void (*levels)(const uint64_t *hist, int maxval, int *lut),
+                 struct image *out, int row_begin, int row_end)
+{
+    uint64_t *hist = (uint64_t *)malloc(sizeof(uint64_t) * ((size_t)img->maxval + 1));
+    int *lut = (int *)malloc(sizeof(int) * ((size_t)img->maxval + 1));
+    if (hist == NULL || lut == NULL || histogram(img, hist) != 0)
+    {
+        fprintf(stderr, "Unable to allocate the histogram\n");
+        exit(EXIT_FAILURE);
+    }
+
+    levels(hist, img->maxval, lut);
+    if (img->maxval > 255)
+        lut_band_16(img, lut, out, row_begin, row_end);
+    else
+        lut_band_8(img, lut, out, row_begin, row_end);
+
+    free(hist);
+    free(lut);
+}
+
+void convolve_separable(struct image *img, struct separable_kernel *sep, struct image *out)
+{
+    convolve_separable_band(img, sep, out, 0, img->height);
+}
+
+void convolve_tiled(struct image *img, kernel_t *kernels[2], struct image *out)
+{
+    convolve_band(img, kernels, out, 0, img->height);
+}
+
+kernel_t edge_detect = {{0, 1, 0},
+                        {1, -4, 1},
+                        {0, 1, 0}};
+
+kernel_t edge_detect2 = {{-1, -1, -1},
+                         {-1, 8, -1},
+                         {-1, -1, -1}};
+
+kernel_t edge_detect_x = {{-1, 0, 1},
+                          {-2, 0, 2},
+                          {-1, 0, 1}};
+
+kernel_t edge_detect_y = {{1, 2, 1},
+                          {0, 0, 0},
+                          {-1, -2, -1}};
+
+kernel_t sharpen = {{0, -1, 0},
+                    {-1, 5, -1},
+                    {0, -1, 0}};
+
+kernel_t box_blur = {{1. / 9, 1. / 9, 1. / 9},
+                     {1. / 9, 1. / 9, 1. / 9},
+                     {1. / 9, 1. / 9, 1. / 9}};
+
+kernel_t gaussian_blur = {{1. / 16, 2. / 16, 1. / 16},
+                          {2. / 16, 4. / 16, 2. / 16},
+                          {1. / 16, 2. / 16, 1. / 16}};
+
+kernel_t identity = {{0, 0, 0},
+                     {0, 1, 0},
+                     {0, 0, 0}};
+
+struct filter
+{
+    const char *name;
+    kernel_t *kernels[2];
+    /* Builds the size x size version of the filter, NULL if there is none */
+    void (*separable)(struct separable_kernel *self, int size);
+    /* Filters over a size x size window without a kernel_t (non-linear or summed-area), NULL for the others */
+    void (*rank)(struct image *img, int size, struct image *out, int row_begin, int row_end);
+    /* Point filters whose levels depend on the histogram of the whole input, NULL for the others */
+    void (*levels)(const uint64_t *hist, int maxval, int *lut);
+};
+
+struct filter filters[] = {
+    {"identity", {&identity, NULL}, NULL, NULL, NULL},
+    {"box_blur", {&box_blur, NULL}, NULL, box_blur_band, NULL}, /* 3x3 : the kernel */
+    {"gaussian_blur", {&gaussian_blur, NULL}, gaussian_blur_separable, NULL, NULL},
+    {"sharpen", {&sharpen, NULL}, NULL, NULL, NULL},
+    {"edge_detect", {&edge_detect, NULL}, NULL, NULL, NULL},
+    {"edge_detect2", {&edge_detect2, NULL}, NULL, NULL, NULL},
+    {"sobel", {&edge_detect_x, &edge_detect_y}, NULL, NULL, NULL},
+    {"median", {NULL, NULL}, NULL, median_band, NULL},
+    {"erode", {NULL, NULL}, NULL, erode_band, NULL},
+    {"dilate", {NULL, NULL}, NULL, dilate_band, NULL},
+    {"mean", {NULL, NULL}, NULL, mean_band, NULL},
+    {"threshold", {NULL, NULL}, NULL, threshold_band, NULL},
+    {"equalize", {NULL, NULL}, NULL, NULL, equalize_levels},
+    {"autolevels", {NULL, NULL}, NULL, NULL, autolevels_levels},
+    {"grey", {&identity, NULL}, NULL, NULL, NULL}, /* see colour_run(), a copy of grey images */
+};
+
+#define NFILTERS (int)(sizeof(filters) / sizeof(filters[0]))
+
+struct filter *
+filter_find(const char *name)
+{
+    for (int i = 0; i < NFILTERS; ++i)
+        if (strcmp(filters[i].name, name) == 0)
+            return &filters[i];
+    return NULL;
+}
+
+/*
+ * Filter chains
+ *
+ * A chain is a list of stages, for instance "gaussian_blur:5,sharpen,edge_detect".
+ * The stages run back to back on chunks of rows : each stage keeps a window
+ * with the input rows it still needs (the current chunk plus radius rows above
+ * and below) and passes the output rows it completes to the next stage. The
+ * intermediate images never exist as a whole, only as a few rows that stay in
+ * the cache, and each source row is read once.
+ *
+ * Rows that are not needed anymore are dropped from the front of the window.
+ * Peak memory is O(width x kernel height) whatever the height of the image,
+ * which is also what the streaming mode (-S) relies on to filter images that
+ * do not fit in memory, read from a pipe.
+ */
+
+#define CHAIN_MAX_STAGES 16
+#define CHAIN_CHUNK_ROWS 32
+
+struct stage
+{
+    struct filter *filter;
+    int size; /* 3 for the kernel_t filters, larger for the separable and rank ones */
+    struct separable_kernel sep;
+    struct image *window; /* input rows [first, first + loaded) */
+    struct image *result; /* output rows, at the same position as in window */
+    int first;
+    int loaded;
+    int done; /* number of output rows already produced */
+    int height;
+};
+
+struct chain
+{
+    int nstages;
+    struct stage stages[CHAIN_MAX_STAGES];
+};
+
+/* Stages are separated by commas or whitespace, with an optional ":size" */
+int chain_parse(struct chain *self, const char *spec)
+{
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    int status = 0;
+
+    self->nstages = 0;
+    for (char *token = strtok_r(copy, ", \t\n", &saveptr); token != NULL && status == 0;
+         token = strtok_r(NULL, ", \t\n", &saveptr))
+    {
+        if (self->nstages == CHAIN_MAX_STAGES)
+        {
+            fprintf(stderr, "Too many stages, at most %d are supported\n", CHAIN_MAX_STAGES);
+            status = -1;
+            break;
+        }
+
+        struct stage *stage = &self->stages[self->nstages];
+        memset(stage, 0, sizeof(*stage));
+
+        char *colon = strchr(token, ':');
+        stage->size = 3;
+        if (colon != NULL)
+        {
+            *colon = '\0';
+            stage->size = atoi(colon + 1);
+        }
+
+        stage->filter = filter_find(token);
+        if (stage->filter == NULL)
+        {
+            fprintf(stderr, "Unknown filter : %s\n", token);
+            status = -1;
+        }
+        else if (stage->size != 3 &&
+                 ((stage->filter->separable == NULL && stage->filter->rank == NULL) || stage->size < 3 ||
+                  stage->size % 2 == 0 ||
+                  stage->size > (stage->filter->rank != NULL ? WINDOW_MAX_SIZE : SEPARABLE_MAX_SIZE)))
+        {
+            fprintf(stderr, "Invalid size for %s : %d\n", stage->filter->name, stage->size);
+            status = -1;
+        }
+        else
+        {
+            if (stage->size != 3 && stage->filter->rank == NULL)
+                stage->filter->separable(&stage->sep, stage->size);
+            ++self->nstages;
+        }
+    }
+
+    if (status == 0 && self->nstages == 0)
+    {
+        fprintf(stderr, "Empty filter chain\n");
+        status = -1;
+    }
+
+    free(copy);
+    return status;
+}
+
+/* Same as chain_parse() with the content of filename; '#' starts a comment */
+int chain_load(struct chain *self, const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open filter chain file : %s\n", filename);
+        return -1;
+    }
+
+    char spec[4096] = "";
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "#")] = '\0';
+        if (strlen(spec) + strlen(line) + 2 > sizeof(spec))
+        {
+            fprintf(stderr, "Filter chain file too large : %s\n", filename);
+            fclose(fp);
+            return -1;
+        }
+        strcat(spec, line);
+        strcat(spec, "\n");
+    }
+    fclose(fp);
+
+    return chain_parse(self, spec);
+}
+
+void stage_band(struct stage *self, struct image *img, struct image *out, int row_begin, int row_end)
+{
+    if (self->filter->levels != NULL)
+        levels_band(img, self->filter->levels, out, row_begin, row_end);
+    else if (self->size == 3 && self->filter->kernels[0] != NULL)
+        convolve_band(img, self->filter->kernels, out, row_begin, row_end);
+    else if (self->filter->rank != NULL)
+        self->filter->rank(img, self->size, out, row_begin, row_end);
+    else
+        convolve_separable_band(img, &self->sep, out, row_begin, row_end);
+}
+
+void chain_stop(struct chain *self)
+{
+    for (int i = 0; i < self->nstages; ++i)
+    {
+        struct stage *stage = &self->stages[i];
+        if (stage->window != NULL)
+            image_free(stage->window);
+        if (stage->result != NULL)
+            image_free(stage->result);
+        stage->window = stage->result = NULL;
+    }
+}
+
+int chain_start(struct chain *self, int height, int width, int maxval)
+{
+    int radius = 0;
+    for (int i = 0; i < self->nstages; ++i)
+        radius += self->stages[i].size / 2;
+
+    /* A stage can receive a chunk plus the rows held back by the previous stages */
+    int capacity = CHAIN_CHUNK_ROWS + 2 * radius;
+
+    for (int i = 0; i < self->nstages; ++i)
+    {
+        struct stage *stage = &self->stages[i];
+        stage->window = image_alloc_maxval(capacity, width, maxval);
+        stage->result = image_alloc_maxval(capacity, width, maxval);
+        if (stage->window == NULL || stage->result == NULL)
+        {
+            fprintf(stderr, "Unable to allocate the filter chain windows\n");
+            chain_stop(self);
+            return -1;
+        }
+        stage->first = stage->loaded = stage->done = 0;
+        stage->height = height;
+    }
+    return 0;
+}
+
+/* Where the rows of the last stage go : a file or the rows of an image */
+struct chain_sink
+{
+    FILE *fp;
+    struct image *img;
+    int row;
+    int maxval;
+};
+
+static int chain_sink_write(struct chain_sink *sink, unsigned char *rows, int count, size_t row_bytes)
+{
+    if (sink->fp != NULL)
+    {
+        /* 16-bit rows are big-endian in the file, they are swapped back once written */
+        size_t nsamples = (size_t)count * row_bytes / 2;
+        if (sink->maxval > 255)
+            pgm_swap16(rows, nsamples);
+        size_t written = fwrite(rows, row_bytes, count, sink->fp);
+        if (sink->maxval > 255)
+            pgm_swap16(rows, nsamples);
+        if (written != (size_t)count)
+        {
+            fprintf(stderr, "Unable to write the output\n");
+            return -1;
+        }
+    }
+    else
+        memcpy(sink->img->raster[sink->row], rows, (size_t)count * row_bytes);
+    sink->row += count;
+    return 0;
+}
+
+/* Feeds count contiguous input rows to stage index and the rows it completes to the next one */
+static int chain_push(struct chain *self, int index, unsigned char *rows, int count, size_t row_bytes,
+                      struct chain_sink *sink)
+{
+    if (index == self->nstages)
+        return chain_sink_write(sink, rows, count, row_bytes);
+
+    struct stage *stage = &self->stages[index];
+    int radius = stage->size / 2;
+    struct image *window = stage->window;
+
+    int drop = stage->done - radius - stage->first;
+    if (drop > 0)
+    {
+        memmove(window->raster[0], window->raster[drop], (size_t)(stage->loaded - drop) * row_bytes);
+        stage->loaded -= drop;
+        stage->first += drop;
+    }
+
+    memcpy(window->raster[stage->loaded], rows, (size_t)count * row_bytes);
+    stage->loaded += count;
+
+    int input_end = stage->first + stage->loaded;
+    int ready = input_end == stage->height ? stage->height : input_end - radius;
+    if (ready <= stage->done)
+        return 0;
+
+    /* The window is an image whose first and last rows are the image borders when they matter */
+    int capacity = window->height;
+    window->height = stage->result->height = stage->loaded;
+    stage_band(stage, window, stage->result, stage->done - stage->first, ready - stage->first);
+    window->height = stage->result->height = capacity;
+
+    unsigned char *produced = stage->result->raster[stage->done - stage->first];
+    int nproduced = ready - stage->done;
+    stage->done = ready;
+    return chain_push(self, index + 1, produced, nproduced, row_bytes, sink);
+}
+
+/* Index of the first stage that needs the histogram of its whole input, -1 if there is none */
+static int chain_find_levels(struct chain *self)
+{
+    for (int i = 0; i < self->nstages; ++i)
+        if (self->stages[i].filter->levels != NULL)
+            return i;
+    return -1;
+}
+
+int chain_run(struct chain *self, struct image *img, struct image *out);
+
+/*
+ * A histogram stage splits the chain : the stages before it are fused into an
+ * intermediate image, the levels are applied to it in place, and the stages
+ * after it run from there.
+ */
+static int chain_run_split(struct chain *self, int split, struct image *img, struct image *out)
+{
+    struct image *tmp = NULL;
+    if (split > 0 || split < self->nstages - 1)
+    {
+        tmp = image_alloc_maxval(img->height, img->width, img->maxval);
+        if (tmp == NULL)
+        {
+            fprintf(stderr, "Unable to allocate the intermediate image\n");
+            return -1;
+        }
+    }
+
+    int status = 0;
+    struct image *src = img;
+    if (split > 0)
+    {
+        struct chain head = *self;
+        head.nstages = split;
+        status = chain_run(&head, img, tmp);
+        src = tmp;
+    }
+
+    if (status == 0 && split == self->nstages - 1)
+        stage_band(&self->stages[split], src, out, 0, img->height);
+    else if (status == 0)
+    {
+        stage_band(&self->stages[split], src, tmp, 0, img->height);
+
+        struct chain tail;
+        tail.nstages = self->nstages - split - 1;
+        memcpy(tail.stages, self->stages + split + 1, sizeof(struct stage) * tail.nstages);
+        status = chain_run(&tail, tmp, out);
+    }
+
+    if (tmp != NULL)
+        image_free(tmp);
+    return status;
+}
+
+/* Applies the chain to img, into out */
+int chain_run(struct chain *self, struct image *img, struct image *out)
+{
+    int split = chain_find_levels(self);
+    if (split >= 0)
+        return chain_run_split(self, split, img, out);
+
+    if (chain_start(self, img->height, img->width, img->maxval) != 0)
+        return -1;
+
+    struct chain_sink sink = {.fp = NULL, .img = out, .row = 0, .maxval = img->maxval};
+    int status = 0;
+    for (int row = 0; row < img->height && status == 0; row += CHAIN_CHUNK_ROWS)
+        status = chain_push(self, 0, img->raster[row], MIN(CHAIN_CHUNK_ROWS, img->height - row),
+                            image_row_bytes(img), &sink);
+
+    chain_stop(self);
+    return status;
+}
+
+/* Applies the chain to the PGM stream in, written to out as it goes */
+int chain_stream(struct chain *self, FILE *in, FILE *out)
+{
+    int height, width, maxval;
+    if (pgm_parse_header(in, &height, &width, &maxval) != 0)
+        return -1;
+    maxval = MAX(maxval, 255);
+
+    int split = chain_find_levels(self);
+    if (split >= 0)
+    {
+        fprintf(stderr, "%s needs the whole image, it cannot be streamed\n", self->stages[split].filter->name);
+        return -1;
+    }
+
+    struct image header = {.height = height, .width = width, .maxval = maxval};
+    pgm_write_header(&header, out);
+
+    struct image *chunk = image_alloc_maxval(CHAIN_CHUNK_ROWS, width, maxval);
+    if (chunk == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the streaming buffer\n");
+        return -1;
+    }
+    if (chain_start(self, height, width, maxval) != 0)
+    {
+        image_free(chunk);
+        return -1;
+    }
+
+    size_t row_bytes = image_row_bytes(chunk);
+    struct chain_sink sink = {.fp = out, .img = NULL, .row = 0, .maxval = maxval};
+    int status = 0;
+    for (int row = 0; row < height && status == 0; row += CHAIN_CHUNK_ROWS)
+    {
+        int count = MIN(CHAIN_CHUNK_ROWS, height - row);
+        if (fread(chunk->raster[0], row_bytes, count, in) != (size_t)count)
+        {
+            fprintf(stderr, "Parsing failed : the raster is truncated\n");
+            status = -1;
+            break;
+        }
+        if (maxval > 255)
+            pgm_load16(chunk->raster[0], (size_t)count * width, maxval);
+        status = chain_push(self, 0, chunk->raster[0], count, row_bytes, &sink);
+    }
+
+    chain_stop(self);
+    image_free(chunk);
+    return status;
+}
+
+/*
+ * Asynchronous streaming
+ *
+ * Same as chain_stream() between regular files, with the reads and writes in
+ * flight while the chain runs : the rows are read in bands of ASYNC_BAND_BYTES,
+ * band k + 1 is read and the output of band k - 1 written with POSIX AIO while
+ * band k goes through the chain. Two buffers on each side are enough, a buffer
+ * is reused once its previous request is complete.
+ */
+
+#define ASYNC_BAND_BYTES (1024 * 1024)
+
+/* Queues the transfer of length bytes at offset; falls back to a synchronous one if it cannot be queued */
+static void async_start(struct aiocb *cb, int fd, void *buffer, size_t length, off_t offset, int write)
+{
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_fildes = fd;
+    cb->aio_buf = buffer;
+    cb->aio_nbytes = length;
+    cb->aio_offset = offset;
+    cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+    if ((write ? aio_write(cb) : aio_read(cb)) != 0)
+        cb->aio_lio_opcode = -1; /* not queued, async_wait() does the transfer */
+    else
+        cb->aio_lio_opcode = write ? LIO_WRITE : LIO_READ;
+}
+
+/* Waits for a transfer started by async_start(), and completes it if it is short; returns 0 on success */
+static int async_wait(struct aiocb *cb, int write)
+{
+    size_t done = 0;
+    if (cb->aio_lio_opcode != -1)
+    {
+        const struct aiocb *list[1] = {cb};
+        while (aio_error(cb) == EINPROGRESS)
+            aio_suspend(list, 1, NULL);
+        ssize_t n = aio_return(cb);
+        if (n < 0)
+            return -1;
+        done = n;
+    }
+
+    unsigned char *buffer = (unsigned char *)cb->aio_buf;
+    while (done < cb->aio_nbytes)
+    {
+        ssize_t n = write ? pwrite(cb->aio_fildes, buffer + done, cb->aio_nbytes - done, cb->aio_offset + done)
+                          : pread(cb->aio_fildes, buffer + done, cb->aio_nbytes - done, cb->aio_offset + done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/* Waits for a transfer that is not needed anymore */
+static void async_drain(struct aiocb *cb)
+{
+    if (cb->aio_lio_opcode == -1)
+        return;
+    const struct aiocb *list[1] = {cb};
+    while (aio_error(cb) == EINPROGRESS)
+        aio_suspend(list, 1, NULL);
+    aio_return(cb);
+}
+
+/* Returns 1 if the chain ran, 0 if the files are not regular ones (nothing is written then), -1 on failure */
+int chain_stream_async(struct chain *self, const char *input, const char *output)
+{
+    int in = open(input, O_RDONLY);
+    if (in == -1)
+    {
+        fprintf(stderr, "Unable to open input file : %s\n", input);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(in, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(in);
+        return 0;
+    }
+
+    unsigned char data[4096];
+    ssize_t length = pread(in, data, sizeof(data), 0);
+    int height, width, maxval;
+    long offset = length > 0 ? pgm_parse_header_mapped(data, length, &width, &height, &maxval) : -1;
+    if (offset < 0)
+    {
+        if (length <= 0)
+            fprintf(stderr, "Parsing failed : magic number 5 expected\n");
+        close(in);
+        return -1;
+    }
+    maxval = MAX(maxval, 255);
+
+    int split = chain_find_levels(self);
+    if (split >= 0)
+    {
+        fprintf(stderr, "%s needs the whole image, it cannot be streamed\n", self->stages[split].filter->name);
+        close(in);
+        return -1;
+    }
+
+    /* The output is checked before O_TRUNC : a pipe is left to stdio untouched, the input is never truncated */
+    struct stat out_st;
+    if (stat(output, &out_st) == 0)
+    {
+        if (!S_ISREG(out_st.st_mode))
+        {
+            close(in);
+            return 0;
+        }
+        if (out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino)
+        {
+            fprintf(stderr, "The output is the input file : %s\n", output);
+            close(in);
+            return -1;
+        }
+    }
+
+    int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out == -1)
+    {
+        fprintf(stderr, "Unable to open output file : %s\n", output);
+        close(in);
+        return -1;
+    }
+
+    char header[64];
+    int header_length = snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", width, height, maxval);
+
+    int radius = 0;
+    for (int i = 0; i < self->nstages; ++i)
+        radius += self->stages[i].size / 2;
+
+    /* A band is a whole number of chunks; its output can also hold the rows held back by the chain */
+    size_t row_bytes = (size_t)width * (maxval > 255 ? 2 : 1);
+    int band_rows = MAX(1, (int)(ASYNC_BAND_BYTES / MAX(row_bytes, 1) / CHAIN_CHUNK_ROWS)) * CHAIN_CHUNK_ROWS;
+    struct image *bands[2];
+    struct image *results[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        bands[i] = image_alloc_maxval(band_rows, width, maxval);
+        results[i] = image_alloc_maxval(band_rows + 2 * radius, width, maxval);
+    }
+
+    int status = 0;
+    if (bands[0] == NULL || bands[1] == NULL || results[0] == NULL || results[1] == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the streaming buffers\n");
+        status = -1;
+    }
+    else if (pwrite(out, header, header_length, 0) != header_length || chain_start(self, height, width, maxval) != 0)
+        status = -1;
+
+    if (status == 0 && (size_t)st.st_size - offset < (size_t)height * row_bytes)
+    {
+        fprintf(stderr, "Parsing failed : the raster is truncated\n");
+        status = -1;
+        chain_stop(self);
+    }
+
+    if (status == 0)
+    {
+        struct aiocb reads[2];
+        struct aiocb writes[2];
+        int reading[2] = {0, 0};
+        int writing[2] = {0, 0};
+        struct chain_sink sink = {.fp = NULL, .img = NULL, .row = 0, .maxval = maxval};
+        off_t written = header_length;
+
+        if (height > 0)
+        {
+            async_start(&reads[0], in, bands[0]->raster[0], MIN(band_rows, height) * row_bytes, offset, 0);
+            reading[0] = 1;
+        }
+
+        for (int band = 0, row = 0; row < height && status == 0; ++band, row += band_rows)
+        {
+            int current = band % 2;
+            int count = MIN(band_rows, height - row);
+            reading[current] = 0;
+            if (async_wait(&reads[current], 0) != 0)
+            {
+                fprintf(stderr, "Unable to read the input\n");
+                status = -1;
+                break;
+            }
+            if (row + count < height)
+            {
+                async_start(&reads[1 - current], in, bands[1 - current]->raster[0],
+                            MIN(band_rows, height - row - count) * row_bytes,
+                            offset + (off_t)(row + count) * row_bytes, 0);
+                reading[1 - current] = 1;
+            }
+
+            /* The output buffer of band k - 2 is free once its write is done */
+            int was_writing = writing[current];
+            writing[current] = 0;
+            if (was_writing && async_wait(&writes[current], 1) != 0)
+            {
+                fprintf(stderr, "Unable to write the output\n");
+                status = -1;
+                break;
+            }
+
+            struct image *input = bands[current];
+            if (maxval > 255)
+                pgm_load16(input->raster[0], (size_t)count * width, maxval);
+            sink.img = results[current];
+            sink.row = 0;
+            for (int chunk = 0; chunk < count && status == 0; chunk += CHAIN_CHUNK_ROWS)
+                status = chain_push(self, 0, input->raster[chunk], MIN(CHAIN_CHUNK_ROWS, count - chunk),
+                                    row_bytes, &sink);
+
+            if (status == 0 && sink.row > 0)
+            {
+                if (maxval > 255)
+                    pgm_swap16(results[current]->raster[0], (size_t)sink.row * width);
+                async_start(&writes[current], out, results[current]->raster[0], sink.row * row_bytes,
+                            written, 1);
+                writing[current] = 1;
+                written += (off_t)sink.row * row_bytes;
+            }
+        }
+
+        /* Every request is complete before its buffer is freed */
+        for (int i = 0; i < 2; ++i)
+        {
+            if (writing[i] && status != 0)
+                async_drain(&writes[i]);
+            else if (writing[i] && async_wait(&writes[i], 1) != 0)
+            {
+                fprintf(stderr, "Unable to write the output\n");
+                status = -1;
+            }
+        }
+        for (int i = 0; i < 2; ++i)
+            if (reading[i])
+                async_drain(&reads[i]);
+        chain_stop(self);
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+        if (bands[i] != NULL)
+            image_free(bands[i]);
+        if (results[i] != NULL)
+            image_free(results[i]);
+    }
+    close(in);
+    close(out);
+    return status == 0 ? 1 : -1;
+}
+
+/*
+ * Colour images
+ *
+ * P6 images are read into three planes (red, green and blue), each a grey
+ * struct image : the filters run on every plane with the same vectorized
+ * paths, and the planes are interleaved again when the output is written.
+ * A chain that starts with the grey stage turns them into a single grey
+ * image instead, with the luma weights of ITU-R BT.601.
+ */
+
+/* Moves the n first pixels of an 8-bit RGB row to or from the planes; returns the number of pixels done */
+typedef int (*rgb_row_t)(unsigned char *interleaved, unsigned char *planes[3], int n);
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * 16 pixels are 3 vectors of 16 bytes. Byte i of plane c is byte 3i + c of
+ * the pixels, so it is gathered from its vector with a byte shuffle, whose
+ * negative indices give zero, and the three shuffles are or'ed together. The
+ * shuffle needs SSSE3, which comes with AVX2.
+ */
+__attribute__((target("avx2"))) static int
+rgb_deinterleave_row_avx2(unsigned char *interleaved, unsigned char *planes[3], int n)
+{
+    __m128i masks[3][3];
+    for (int c = 0; c < 3; ++c)
+        for (int v = 0; v < 3; ++v)
+        {
+            char mask[16];
+            for (int i = 0; i < 16; ++i)
+                mask[i] = (3 * i + c) / 16 == v ? (3 * i + c) % 16 : -1;
+            masks[c][v] = _mm_loadu_si128((const __m128i *)mask);
+        }
+
+    int j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        const unsigned char *src = interleaved + 3 * j;
+        __m128i p0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i p2 = _mm_loadu_si128((const __m128i *)(src + 32));
+        for (int c = 0; c < 3; ++c)
+        {
+            __m128i plane = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, masks[c][0]),
+                                                      _mm_shuffle_epi8(p1, masks[c][1])),
+                                         _mm_shuffle_epi8(p2, masks[c][2]));
+            _mm_storeu_si128((__m128i *)(planes[c] + j), plane);
+        }
+    }
+    return j;
+}
+
+/* The other way round : byte k of the pixels is byte k / 3 of plane k % 3 */
+__attribute__((target("avx2"))) static int
+rgb_interleave_row_avx2(unsigned char *interleaved, unsigned char *planes[3], int n)
+{
+    __m128i masks[3][3];
+    for (int v = 0; v < 3; ++v)
+        for (int c = 0; c < 3; ++c)
+        {
+            char mask[16];
+            for (int k = 0; k < 16; ++k)
+                mask[k] = (16 * v + k) % 3 == c ? (16 * v + k) / 3 : -1;
+            masks[v][c] = _mm_loadu_si128((const __m128i *)mask);
+        }
+
+    int j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i r = _mm_loadu_si128((const __m128i *)(planes[0] + j));
+        __m128i g = _mm_loadu_si128((const __m128i *)(planes[1] + j));
+        __m128i b = _mm_loadu_si128((const __m128i *)(planes[2] + j));
+        for (int v = 0; v < 3; ++v)
+        {
+            __m128i pixels = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, masks[v][0]),
+                                                       _mm_shuffle_epi8(g, masks[v][1])),
+                                          _mm_shuffle_epi8(b, masks[v][2]));
+            _mm_storeu_si128((__m128i *)(interleaved + 3 * j + 16 * v), pixels);
+        }
+    }
+    return j;
+}
+#endif
+
+/* The vectorized row function for 8-bit pixels, NULL if there is none */
+rgb_row_t rgb_row_select(int maxval, int interleave)
+{
+    int level = simd_supported();
+    if (simd_level >= 0)
+        level = MIN(level, simd_level);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (level >= SIMD_AVX2 && maxval <= 255)
+        return interleave ? rgb_interleave_row_avx2 : rgb_deinterleave_row_avx2;
+#else
+    (void)level;
+    (void)maxval;
+    (void)interleave;
+#endif
+    return NULL;
+}
+
+/* Row of the file (16-bit samples are big-endian) to row of planes, or back */
+void rgb_convert_row(unsigned char *interleaved, struct image *planes[3], int row, int interleave,
+                     rgb_row_t vectorized)
+{
+    int width = planes[0]->width;
+    if (planes[0]->maxval > 255)
+    {
+        for (int col = 0; col < width; ++col)
+            for (int c = 0; c < 3; ++c)
+            {
+                unsigned char *sample = interleaved + 2 * (3 * (size_t)col + c);
+                unsigned short *pixel = (unsigned short *)planes[c]->raster[row] + col;
+                if (interleave)
+                {
+                    sample[0] = *pixel >> 8;
+                    sample[1] = *pixel & 0xff;
+                }
+                else
+                    *pixel = sample[0] << 8 | sample[1];
+            }
+        return;
+    }
+
+    unsigned char *rows[3] = {planes[0]->raster[row], planes[1]->raster[row], planes[2]->raster[row]};
+    int col = vectorized != NULL ? vectorized(interleaved, rows, width) : 0;
+    for (; col < width; ++col)
+        for (int c = 0; c < 3; ++c)
+        {
+            if (interleave)
+                interleaved[3 * col + c] = rows[c][col];
+            else
+                rows[c][col] = interleaved[3 * col + c];
+        }
+}
+
+/* Returns 1 if filename starts with the P6 magic number */
+int ppm_is_colour(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+        return 0;
+    char magic[2] = "";
+    int colour = fread(magic, 1, 2, fp) == 2 && magic[0] == 'P' && magic[1] == '6';
+    fclose(fp);
+    return colour;
+}
+
+/* Reads a P6 image into planes; returns 0 on success */
+int ppm_parse(FILE *fp, struct image *planes[3])
+{
+    int magic, height, width, maxval;
+    if (pnm_parse_header(fp, &magic, &height, &width, &maxval) != 0)
+        return -1;
+    if (magic != 6)
+    {
+        fprintf(stderr, "Parsing failed : magic number 6 expected, got %d instead\n", magic);
+        return -1;
+    }
+
+    /* Like the grey images, 8-bit planes get a maximum value of 255 */
+    maxval = MAX(maxval, 255);
+    size_t row_bytes = 3 * (size_t)width * (maxval > 255 ? 2 : 1);
+    unsigned char *row = (unsigned char *)malloc(row_bytes);
+    for (int c = 0; c < 3; ++c)
+        planes[c] = image_alloc_maxval(height, width, maxval);
+    if (row == NULL || planes[0] == NULL || planes[1] == NULL || planes[2] == NULL)
+    {
+        fprintf(stderr, "Unable to allocate image struct\n");
+        free(row);
+        for (int c = 0; c < 3; ++c)
+            if (planes[c] != NULL)
+                image_free(planes[c]);
+        return -1;
+    }
+
+    int status = 0;
+    rgb_row_t deinterleave = rgb_row_select(maxval, 0);
+    for (int i = 0; i < height && status == 0; ++i)
+    {
+        if (fread(row, row_bytes, 1, fp) != 1)
+        {
+            fprintf(stderr, "Parsing failed : the raster is truncated\n");
+            status = -1;
+        }
+        else
+        {
+            rgb_convert_row(row, planes, i, 0, deinterleave);
+            for (int c = 0; c < 3 && maxval > 255; ++c)
+                pgm_clamp16((unsigned short *)planes[c]->raster[i], width, maxval);
+        }
+    }
+
+    free(row);
+    for (int c = 0; c < 3 && status != 0; ++c)
+        image_free(planes[c]);
+    return status;
+}
+
+void ppm_write(struct image *planes[3], FILE *fp)
+{
+    fprintf(fp, "P6\n");
+    fprintf(fp, "%d %d\n", planes[0]->width, planes[0]->height);
+    fprintf(fp, "%d\n", planes[0]->maxval);
+
+    size_t row_bytes = 3 * image_row_bytes(planes[0]);
+    unsigned char *row = (unsigned char *)malloc(row_bytes);
+    rgb_row_t interleave = rgb_row_select(planes[0]->maxval, 1);
+    for (int i = 0; i < planes[0]->height && row != NULL; ++i)
+    {
+        rgb_convert_row(row, planes, i, 1, interleave);
+        fwrite(row, row_bytes, 1, fp);
+    }
+    free(row);
+}
+
+/* Y = 0.299 R + 0.587 G + 0.114 B, in 16-bit fixed point and rounded */
+struct image *
+rgb_to_grey(struct image *planes[3])
+{
+    struct image *grey = image_alloc_maxval(planes[0]->height, planes[0]->width, planes[0]->maxval);
+    if (grey == NULL)
+        return NULL;
+
+    for (int i = 0; i < grey->height; ++i)
+    {
+        if (grey->maxval > 255)
+        {
+            const unsigned short *r = (const unsigned short *)planes[0]->raster[i];
+            const unsigned short *g = (const unsigned short *)planes[1]->raster[i];
+            const unsigned short *b = (const unsigned short *)planes[2]->raster[i];
+            unsigned short *dst = (unsigned short *)grey->raster[i];
+            for (int col = 0; col < grey->width; ++col)
+                dst[col] = (19595u * r[col] + 38470u * g[col] + 7471u * b[col] + 32768u) >> 16;
+        }
+        else
+        {
+            const unsigned char *r = planes[0]->raster[i];
+            const unsigned char *g = planes[1]->raster[i];
+            const unsigned char *b = planes[2]->raster[i];
+            unsigned char *dst = grey->raster[i];
+            for (int col = 0; col < grey->width; ++col)
+                dst[col] = (19595u * r[col] + 38470u * g[col] + 7471u * b[col] + 32768u) >> 16;
+        }
+    }
+    return grey;
+}
+
+/*
+ * Applies the chain to every plane of the colour image input, or to its grey
+ * version when the chain starts with the grey stage; returns 0 on success.
+ */
+int colour_run(struct chain *chain, const char *input, const char *output)
+{
+    int to_grey = strcmp(chain->stages[0].filter->name, "grey") == 0;
+    for (int i = to_grey; i < chain->nstages; ++i)
+    {
+        if (strcmp(chain->stages[i].filter->name, "grey") == 0)
+        {
+            fprintf(stderr, "grey can only be the first stage of a colour image\n");
+            return -1;
+        }
+    }
+
+    FILE *fp = fopen(input, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open input file : %s\n", input);
+        return -1;
+    }
+    struct image *planes[3];
+    int status = ppm_parse(fp, planes);
+    fclose(fp);
+    if (status != 0)
+        return -1;
+
+    int nplanes = 3;
+    if (to_grey)
+    {
+        struct image *grey = rgb_to_grey(planes);
+        for (int c = 0; c < 3; ++c)
+            image_free(planes[c]);
+        if (grey == NULL)
+        {
+            fprintf(stderr, "Unable to allocate image struct\n");
+            return -1;
+        }
+        planes[0] = grey;
+        nplanes = 1;
+
+        --chain->nstages;
+        memmove(chain->stages, chain->stages + 1, sizeof(struct stage) * chain->nstages);
+    }
+
+    struct image *out[3] = {NULL, NULL, NULL};
+    for (int c = 0; c < nplanes && status == 0; ++c)
+    {
+        if (chain->nstages == 0)
+        {
+            out[c] = planes[c];
+            planes[c] = NULL;
+            continue;
+        }
+
+        out[c] = image_alloc_maxval(planes[c]->height, planes[c]->width, planes[c]->maxval);
+        if (out[c] == NULL)
+        {
+            fprintf(stderr, "Unable to allocate image struct\n");
+            status = -1;
+        }
+        else if (chain->nstages == 1)
+            stage_band(&chain->stages[0], planes[c], out[c], 0, planes[c]->height);
+        else
+            status = chain_run(chain, planes[c], out[c]);
+    }
+
+    if (status == 0)
+    {
+        fp = fopen(output, "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open output file : %s\n", output);
+            status = -1;
+        }
+        else
+        {
+            if (nplanes == 1)
+            {
+                pgm_write_header(out[0], fp);
+                pgm_write_raster(out[0], fp);
+            }
+            else
+                ppm_write(out, fp);
+            fclose(fp);
+        }
+    }
+
+    for (int c = 0; c < nplanes; ++c)
+    {
+        if (planes[c] != NULL)
+            image_free(planes[c]);
+        if (out[c] != NULL)
+            image_free(out[c]);
+    }
+    return status;
+}
+
+/*
+ * Batch mode
+ *
+ * A list of files goes through a pipeline of threads started once : a reader
+ * decodes the files, nworkers filter them and a writer encodes the results.
+ * Bounded queues between the stages let the reader and the writer overlap
+ * with the filtering of the other files. The rasters are recycled through a
+ * pool instead of being allocated and freed for each file : a pooled image is
+ * reshaped to the next file when its buffers are large enough.
+ */
+
+#define BATCH_QUEUE_SIZE 16
+#define RASTER_POOL_SIZE 64
+
+struct pooled_image
+{
+    struct image img; /* first, so that a struct image * is also a struct pooled_image * */
+    size_t capacity;  /* bytes of pixels */
+    int capacity_rows;
+};
+
+struct raster_pool
+{
+    pthread_mutex_t lock;
+    int nfree;
+    struct pooled_image *free[RASTER_POOL_SIZE];
+};
+
+struct image *
+raster_pool_acquire(struct raster_pool *self, int height, int width, int maxval)
+{
+    size_t row_bytes = (size_t)width * (maxval > 255 ? 2 : 1);
+    size_t bytes = MAX((size_t)height * row_bytes, 1);
+
+    struct pooled_image *pooled = NULL;
+    pthread_mutex_lock(&self->lock);
+    for (int i = 0; i < self->nfree && pooled == NULL; ++i)
+    {
+        if (self->free[i]->capacity >= bytes && self->free[i]->capacity_rows >= height)
+        {
+            pooled = self->free[i];
+            self->free[i] = self->free[--self->nfree];
+        }
+    }
+    /* Too small for this file : its buffers are grown below */
+    if (pooled == NULL && self->nfree > 0)
+        pooled = self->free[--self->nfree];
+    pthread_mutex_unlock(&self->lock);
+
+    if (pooled == NULL)
+    {
+        pooled = (struct pooled_image *)calloc(1, sizeof(struct pooled_image));
+        if (pooled == NULL)
+            return NULL;
+    }
+
+    struct image *img = &pooled->img;
+    if (pooled->capacity < bytes || pooled->capacity_rows < height)
+    {
+        raster_free(img->raster);
+        img->raster = raster_alloc(MAX(height, 1), bytes / MAX(height, 1));
+        if (img->raster == NULL)
+        {
+            free(pooled);
+            return NULL;
+        }
+        pooled->capacity = bytes;
+        pooled->capacity_rows = MAX(height, 1);
+    }
+
+    img->height = height;
+    img->width = width;
+    img->maxval = maxval;
+    for (int i = 1; i < height; ++i)
+        img->raster[i] = img->raster[0] + (size_t)i * row_bytes;
+    return img;
+}
+
+void raster_pool_release(struct raster_pool *self, struct image *img)
+{
+    struct pooled_image *pooled = (struct pooled_image *)img;
+    pthread_mutex_lock(&self->lock);
+    if (self->nfree < RASTER_POOL_SIZE)
+    {
+        self->free[self->nfree++] = pooled;
+        pooled = NULL;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    if (pooled != NULL)
+    {
+        raster_free(pooled->img.raster);
+        free(pooled);
+    }
+}
+
+void raster_pool_destroy(struct raster_pool *self)
+{
+    for (int i = 0; i < self->nfree; ++i)
+    {
+        raster_free(self->free[i]->img.raster);
+        free(self->free[i]);
+    }
+    self->nfree = 0;
+    pthread_mutex_destroy(&self->lock);
+}
+
+/* Same as pgm_parse(), into an image of the pool */
+struct image *
+pgm_parse_pooled(FILE *fp, struct raster_pool *pool)
+{
+    int width, height, maxval;
+    if (pgm_parse_header(fp, &height, &width, &maxval) != 0)
+        return NULL;
+
+    struct image *img = raster_pool_acquire(pool, height, width, maxval > 255 ? maxval : 255);
+    if (img == NULL)
+    {
+        fprintf(stderr, "Unable to allocate image struct\n");
+        return NULL;
+    }
+
+    if (fread(img->raster[0], image_row_bytes(img), height, fp) != (size_t)height)
+    {
+        fprintf(stderr, "Parsing failed : the raster is truncated\n");
+        raster_pool_release(pool, img);
+        return NULL;
+    }
+    if (img->maxval > 255)
+        pgm_load16(img->raster[0], (size_t)height * width, maxval);
+    return img;
+}
+
+struct batch_item
+{
+    int index; /* in the list of files, -1 once there is nothing left */
+    struct image *img;
+    struct image *out;
+};
+
+struct batch_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct batch_item items[BATCH_QUEUE_SIZE];
+    int head;
+    int count;
+    int closed; /* set by batch_queue_close() to stop the threads */
+};
+
+void batch_queue_init(struct batch_queue *self)
+{
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->not_empty, NULL);
+    pthread_cond_init(&self->not_full, NULL);
+    self->head = self->count = self->closed = 0;
+}
+
+void batch_queue_destroy(struct batch_queue *self)
+{
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->not_empty);
+    pthread_cond_destroy(&self->not_full);
+}
+
+/* Returns -1 without queuing item once the queue is closed */
+int batch_queue_push(struct batch_queue *self, struct batch_item item)
+{
+    pthread_mutex_lock(&self->lock);
+    while (self->count == BATCH_QUEUE_SIZE && !self->closed)
+        pthread_cond_wait(&self->not_full, &self->lock);
+    int status = self->closed ? -1 : 0;
+    if (status == 0)
+    {
+        self->items[(self->head + self->count++) % BATCH_QUEUE_SIZE] = item;
+        pthread_cond_signal(&self->not_empty);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return status;
+}
+
+/* Returns an end marker once the queue is closed, even if items are left */
+struct batch_item batch_queue_pop(struct batch_queue *self)
+{
+    struct batch_item item = {-1, NULL, NULL};
+    pthread_mutex_lock(&self->lock);
+    while (self->count == 0 && !self->closed)
+        pthread_cond_wait(&self->not_empty, &self->lock);
+    if (!self->closed)
+    {
+        item = self->items[self->head];
+        self->head = (self->head + 1) % BATCH_QUEUE_SIZE;
+        --self->count;
+        pthread_cond_signal(&self->not_full);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return item;
+}
+
+/* Wakes up the threads blocked on the queue; the items left stay for batch_queue_drain() */
+void batch_queue_close(struct batch_queue *self)
+{
+    pthread_mutex_lock(&self->lock);
+    self->closed = 1;
+    pthread_cond_broadcast(&self->not_empty);
+    pthread_cond_broadcast(&self->not_full);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/* Gives the images of the items left in a closed queue back to pool, once its threads are joined */
+void batch_queue_drain(struct batch_queue *self, struct raster_pool *pool)
+{
+    for (; self->count > 0; --self->count)
+    {
+        struct batch_item *item = &self->items[self->head];
+        if (item->img != NULL)
+            raster_pool_release(pool, item->img);
+        if (item->out != NULL)
+            raster_pool_release(pool, item->out);
+        self->head = (self->head + 1) % BATCH_QUEUE_SIZE;
+    }
+}
+
+struct batch
+{
+    struct chain *chain;
+    char **inputs;
+    char **outputs;
+    int nfiles;
+    int nworkers;
+    struct raster_pool pool;
+    struct batch_queue decoded;
+    struct batch_queue filtered;
+    pthread_mutex_t lock;
+    int nfailed;
+};
+
+static void batch_failed(struct batch *self)
+{
+    pthread_mutex_lock(&self->lock);
+    ++self->nfailed;
+    pthread_mutex_unlock(&self->lock);
+}
+
+static void *batch_reader(void *arg)
+{
+    struct batch *self = (struct batch *)arg;
+    for (int i = 0; i < self->nfiles; ++i)
+    {
+        FILE *fp = fopen(self->inputs[i], "r");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open input file : %s\n", self->inputs[i]);
+            batch_failed(self);
+            continue;
+        }
+        struct image *img = pgm_parse_pooled(fp, &self->pool);
+        fclose(fp);
+        if (img == NULL)
+        {
+            fprintf(stderr, "Skipping %s\n", self->inputs[i]);
+            batch_failed(self);
+            continue;
+        }
+
+        struct batch_item item = {i, img, NULL};
+        if (batch_queue_push(&self->decoded, item) != 0)
+        {
+            raster_pool_release(&self->pool, img);
+            break;
+        }
+    }
+
+    /* One end marker per worker */
+    for (int i = 0; i < self->nworkers; ++i)
+    {
+        struct batch_item end = {-1, NULL, NULL};
+        batch_queue_push(&self->decoded, end);
+    }
+    return NULL;
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch *self = (struct batch *)arg;
+    struct chain chain = *self->chain; /* the stages keep their windows, one copy per worker */
+
+    for (;;)
+    {
+        struct batch_item item = batch_queue_pop(&self->decoded);
+        if (item.index < 0)
+            break;
+
+        struct image *img = item.img;
+        item.out = raster_pool_acquire(&self->pool, img->height, img->width, img->maxval);
+        int status = item.out == NULL ? -1 : 0;
+        if (status == 0 && chain.nstages == 1)
+            stage_band(&chain.stages[0], img, item.out, 0, img->height);
+        else if (status == 0)
+            status = chain_run(&chain, img, item.out);
+        raster_pool_release(&self->pool, img);
+        item.img = NULL;
+
+        if (status != 0)
+        {
+            fprintf(stderr, "Unable to filter %s\n", self->inputs[item.index]);
+            if (item.out != NULL)
+                raster_pool_release(&self->pool, item.out);
+            batch_failed(self);
+            continue;
+        }
+        if (batch_queue_push(&self->filtered, item) != 0)
+            raster_pool_release(&self->pool, item.out);
+    }
+
+    struct batch_item end = {-1, NULL, NULL};
+    batch_queue_push(&self->filtered, end);
+    return NULL;
+}
+
+static void *batch_writer(void *arg)
+{
+    struct batch *self = (struct batch *)arg;
+    for (int nended = 0; nended < self->nworkers;)
+    {
+        struct batch_item item = batch_queue_pop(&self->filtered);
+        if (item.index < 0)
+        {
+            ++nended;
+            continue;
+        }
+
+        FILE *fp = fopen(self->outputs[item.index], "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open output file : %s\n", self->outputs[item.index]);
+            batch_failed(self);
+        }
+        else
+        {
+            pgm_write_header(item.out, fp);
+            pgm_write_raster(item.out, fp);
+            if (fclose(fp) != 0)
+            {
+                fprintf(stderr, "Unable to write the output : %s\n", self->outputs[item.index]);
+                batch_failed(self);
+            }
+        }
+        raster_pool_release(&self->pool, item.out);
+    }
+    return NULL;
+}
+
+/*
+ * Filters inputs[i] into outputs[i] for every file; returns the number of
+ * files that failed, or -1 if the threads could not be started
+ */
+int batch_run(struct chain *chain, char **inputs, char **outputs, int nfiles, int nworkers)
+{
+    struct batch self = {.chain = chain, .inputs = inputs, .outputs = outputs, .nfiles = nfiles,
+                         .nworkers = MAX(nworkers, 1), .nfailed = 0};
+    pthread_mutex_init(&self.pool.lock, NULL);
+    self.pool.nfree = 0;
+    pthread_mutex_init(&self.lock, NULL);
+    batch_queue_init(&self.decoded);
+    batch_queue_init(&self.filtered);
+
+    pthread_t *workers = (pthread_t *)calloc(self.nworkers, sizeof(pthread_t));
+    pthread_t reader, writer;
+    if (workers == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the batch workers\n");
+        return -1;
+    }
+
+    /* The queues only end once every thread has been started : otherwise they are closed */
+    int nstarted = 0;
+    int err = pthread_create(&reader, NULL, batch_reader, &self);
+    int reader_started = err == 0;
+    while (err == 0 && nstarted < self.nworkers)
+        if ((err = pthread_create(&workers[nstarted], NULL, batch_worker, &self)) == 0)
+            ++nstarted;
+    if (err == 0)
+        err = pthread_create(&writer, NULL, batch_writer, &self);
+    if (err != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        batch_queue_close(&self.decoded);
+        batch_queue_close(&self.filtered);
+    }
+
+    if (reader_started)
+        pthread_join(reader, NULL);
+    for (int i = 0; i < nstarted; ++i)
+        pthread_join(workers[i], NULL);
+    if (err == 0)
+        pthread_join(writer, NULL);
+
+    batch_queue_drain(&self.decoded, &self.pool);
+    batch_queue_drain(&self.filtered, &self.pool);
+    free(workers);
+    batch_queue_destroy(&self.decoded);
+    batch_queue_destroy(&self.filtered);
+    raster_pool_destroy(&self.pool);
+    pthread_mutex_destroy(&self.lock);
+    return err != 0 ? -1 : self.nfailed;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Doubles the capacity of names; returns -1, names unchanged, if it cannot */
+static int batch_grow(char ***names, int *capacity)
+{
+    char **grown = (char **)realloc(*names, sizeof(char *) * *capacity * 2);
+    if (grown == NULL)
+        return -1;
+    *names = grown;
+    *capacity *= 2;
+    return 0;
+}
+
+static void batch_names_free(char **names, int n)
+{
+    for (int i = 0; i < n; ++i)
+        free(names[i]);
+    free(names);
+}
+
+/*
+ * The files of a batch : the .pgm files of a directory, or the lines of a
+ * manifest (one path per line, '#' starts a comment). Each output is the
+ * file of the same name in output_dir. Returns the number of files, or -1.
+ */
+int batch_list(const char *list, const char *output_dir, char ***inputs, char ***outputs)
+{
+    int nfiles = 0;
+    int capacity = 256;
+    char **names = (char **)malloc(sizeof(char *) * capacity);
+    if (names == NULL)
+        return -1;
+
+    int failed = 0;
+    struct stat st;
+    if (stat(list, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(list);
+        if (dir == NULL)
+        {
+            fprintf(stderr, "Unable to open directory : %s\n", list);
+            free(names);
+            return -1;
+        }
+        struct dirent *entry;
+        while (!failed && (entry = readdir(dir)) != NULL)
+        {
+            size_t length = strlen(entry->d_name);
+            if (length < 4 || strcmp(entry->d_name + length - 4, ".pgm") != 0)
+                continue;
+            if (nfiles == capacity && batch_grow(&names, &capacity) != 0)
+                failed = 1;
+            else if ((names[nfiles] = (char *)malloc(strlen(list) + length + 2)) == NULL)
+                failed = 1;
+            else
+                sprintf(names[nfiles++], "%s/%s", list, entry->d_name);
+        }
+        closedir(dir);
+        qsort(names, nfiles, sizeof(char *), compare_names);
+    }
+    else
+    {
+        FILE *fp = fopen(list, "r");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open manifest : %s\n", list);
+            free(names);
+            return -1;
+        }
+        char line[4096];
+        while (!failed && fgets(line, sizeof(line), fp) != NULL)
+        {
+            line[strcspn(line, "#\r\n")] = '\0';
+            if (line[0] == '\0')
+                continue;
+            if (nfiles == capacity && batch_grow(&names, &capacity) != 0)
+                failed = 1;
+            else if ((names[nfiles] = strdup(line)) == NULL)
+                failed = 1;
+            else
+                ++nfiles;
+        }
+        fclose(fp);
+    }
+
+    char **paths = failed ? NULL : (char **)malloc(sizeof(char *) * MAX(nfiles, 1));
+    int npaths = 0;
+    for (; paths != NULL && npaths < nfiles; ++npaths)
+    {
+        const char *slash = strrchr(names[npaths], '/');
+        const char *base = slash == NULL ? names[npaths] : slash + 1;
+        paths[npaths] = (char *)malloc(strlen(output_dir) + strlen(base) + 2);
+        if (paths[npaths] == NULL)
+            break;
+        sprintf(paths[npaths], "%s/%s", output_dir, base);
+    }
+
+    if (paths == NULL || npaths < nfiles)
+    {
+        fprintf(stderr, "Unable to allocate the list of files\n");
+        batch_names_free(names, nfiles);
+        if (paths != NULL)
+            batch_names_free(paths, npaths);
+        return -1;
+    }
+
+    *inputs = names;
+    *outputs = paths;
+    return nfiles;
+}
+
+/*
+ * Regression check : every filter is applied with convolve() and with
+ * convolve_tiled(), and both outputs must be byte-identical. Returns the
+ * number of mismatching filters.
+ */
+int check_image(struct image *img, const char *label)
+{
+    int nfailed = 0;
+    struct image *ref = image_alloc_maxval(img->height, img->width, img->maxval);
+    struct image *out = image_alloc_maxval(img->height, img->width, img->maxval);
+
+    for (int i = 0; i < NFILTERS; ++i)
+    {
+        if (filters[i].rank != NULL || filters[i].levels != NULL)
+            continue;
+        if (img->maxval > 255)
+            convolve_reference_16(img, filters[i].kernels, ref);
+        else
+            convolve(img, filters[i].kernels, ref);
+        convolve_tiled(img, filters[i].kernels, out);
+
+        int mismatch = -1;
+        for (int p = 0; p < img->height * img->width && mismatch < 0; ++p)
+            if (pixel_get(ref, p) != pixel_get(out, p))
+                mismatch = p;
+
+        if (mismatch >= 0)
+        {
+            fprintf(stderr, "%s %s : mismatch at row %d, col %d (%d instead of %d)\n",
+                    label, filters[i].name, mismatch / img->width, mismatch % img->width,
+                    pixel_get(out, mismatch), pixel_get(ref, mismatch));
+            ++nfailed;
+        }
+    }
+
+    image_free(ref);
+    image_free(out);
+    return nfailed;
+}
+
+/*
+ * Quantized mode : every filter is applied with the double kernels and with
+ * the fixed-point ones, and the pixels where the rounding of the weights
+ * changes the output are reported. Only the filters with an exact fixed-point
+ * form must give identical outputs; returns the number of those that do not.
+ */
+int check_quantized(struct image *img, const char *label)
+{
+    int nfailed = 0;
+    struct image *ref = image_alloc_maxval(img->height, img->width, img->maxval);
+    struct image *out = image_alloc_maxval(img->height, img->width, img->maxval);
+
+    for (int i = 0; i < NFILTERS; ++i)
+    {
+        if (filters[i].rank != NULL || filters[i].levels != NULL)
+            continue;
+        if (img->maxval > 255)
+            convolve_reference_16(img, filters[i].kernels, ref);
+        else
+            convolve(img, filters[i].kernels, ref);
+        quantize = 1;
+        convolve_tiled(img, filters[i].kernels, out);
+        quantize = 0;
+
+        long ndiffs = 0;
+        int max_diff = 0;
+        size_t first = 0;
+        for (size_t p = 0; p < (size_t)img->height * img->width; ++p)
+        {
+            int diff = abs(pixel_get(out, p) - pixel_get(ref, p));
+            if (diff == 0)
+                continue;
+            if (ndiffs++ == 0)
+                first = p;
+            max_diff = MAX(max_diff, diff);
+        }
+        if (ndiffs == 0)
+            continue;
+
+        int exact = 1;
+        struct qkernel q;
+        for (int m = 0; m < 2 && filters[i].kernels[m] != NULL; ++m)
+            if (qkernel_init(&q, *filters[i].kernels[m], img->maxval) != 0)
+                exact = 0;
+
+        fprintf(exact ? stderr : stdout,
+                "%s %s : %ld pixel(s) rounded differently in quantized mode, by up to %d, "
+                "first at row %d, col %d\n",
+                label, filters[i].name, ndiffs, max_diff, (int)(first / img->width), (int)(first % img->width));
+        if (exact)
+            ++nfailed;
+    }
+
+    image_free(ref);
+    image_free(out);
+    return nfailed;
+}
+
+/*
+ * The other gradient norms are checked against the reference convolution
+ * with the same norm : identical for l1 and linf, within one for the
+ * estimates of the fast norm.
+ */
+int check_norms(struct image *img, const char *label)
+{
+    int nfailed = 0;
+    struct image *ref = image_alloc_maxval(img->height, img->width, img->maxval);
+    struct image *out = image_alloc_maxval(img->height, img->width, img->maxval);
+
+    for (int norm = NORM_FAST; norm <= NORM_LINF; ++norm)
+    {
+        gradient_norm = norm;
+        for (int i = 0; i < NFILTERS; ++i)
+        {
+            if (filters[i].rank != NULL || filters[i].kernels[1] == NULL)
+                continue;
+            if (img->maxval > 255)
+                convolve_reference_16(img, filters[i].kernels, ref);
+            else
+                convolve_reference_8(img, filters[i].kernels, ref);
+            convolve_tiled(img, filters[i].kernels, out);
+
+            int tolerance = norm == NORM_FAST ? 1 : 0;
+            for (size_t p = 0; p < (size_t)img->height * img->width; ++p)
+            {
+                if (abs(pixel_get(out, p) - pixel_get(ref, p)) > tolerance)
+                {
+                    fprintf(stderr, "%s %s (%s) : mismatch at row %d, col %d (%d instead of %d)\n",
+                            label, filters[i].name, norm_names[norm], (int)(p / img->width),
+                            (int)(p % img->width), pixel_get(out, p), pixel_get(ref, p));
+                    ++nfailed;
+                    break;
+                }
+            }
+        }
+    }
+    gradient_norm = NORM_L2;
+
+    image_free(ref);
+    image_free(out);
+    return nfailed;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Rank filters are checked against a sort of each window, with the border pixels repeated */
+int check_rank(struct image *img, const char *label)
+{
+    const char *names[] = {"median", "erode", "dilate"};
+    const int sizes[] = {3, 5, 9};
+    int nfailed = 0;
+    struct image *out = image_alloc_maxval(img->height, img->width, img->maxval);
+    int window[81];
+
+    for (int n = 0; n < 3; ++n)
+    {
+        struct filter *filter = filter_find(names[n]);
+        for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); ++s)
+        {
+            int size = sizes[s];
+            int radius = size / 2;
+            filter->rank(img, size, out, 0, img->height);
+
+            for (int row = 0; row < img->height; ++row)
+            {
+                int mismatch = -1;
+                for (int col = 0; col < img->width && mismatch < 0; ++col)
+                {
+                    for (int k = 0; k < size; ++k)
+                    {
+                        for (int l = 0; l < size; ++l)
+                        {
+                            int r = MIN(MAX(row + k - radius, 0), img->height - 1);
+                            int c = MIN(MAX(col + l - radius, 0), img->width - 1);
+                            window[k * size + l] = pixel_get(img, (size_t)r * img->width + c);
+                        }
+                    }
+                    qsort(window, size * size, sizeof(int), compare_int);
+                    int expected = n == 0 ? window[size * size / 2] : n == 1 ? window[0] : window[size * size - 1];
+                    if (pixel_get(out, (size_t)row * img->width + col) != expected)
+                        mismatch = col;
+                }
+                if (mismatch >= 0)
+                {
+                    fprintf(stderr, "%s %s:%d : mismatch at row %d, col %d\n", label, names[n], size, row, mismatch);
+                    ++nfailed;
+                    break;
+                }
+            }
+        }
+    }
+
+    image_free(out);
+    return nfailed;
+}
+
+/*
+ * The median of 16-bit pixels searches a coarse histogram, then a fine bin, so
+ * a small window costs less than a large one. A search over every level made
+ * median:5 several times slower than median:31 on random 16-bit pixels.
+ */
+int check_rank_cost(const char *label)
+{
+    const int sizes[] = {5, 31};
+    clock_t times[2];
+    struct image *img = image_alloc_maxval(512, 512, 65535);
+    struct image *out = image_alloc_maxval(img->height, img->width, img->maxval);
+    for (int p = 0; p < img->height * img->width; ++p)
+        pixel_set(img, p, rand() % 65536);
+
+    for (int s = 0; s < 2; ++s)
+    {
+        clock_t start = clock();
+        filter_find("median")->rank(img, sizes[s], out, 0, img->height);
+        times[s] = clock() - start;
+    }
+
+    image_free(img);
+    image_free(out);
+    if (times[0] > 2 * times[1])
+    {
+        fprintf(stderr, "%s median:%d of 16-bit pixels : %.3f s, against %.3f s for median:%d\n", label,
+                sizes[0], (double)times[0] / CLOCKS_PER_SEC, (double)times[1] / CLOCKS_PER_SEC, sizes[1]);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * The summed-area table filters built by one thread are checked against sums
+ * over each window when exhaustive is set, and the tables built by several
+ * threads against the ones built by one.
+ */
+int check_integral(struct image *img, const char *label, int exhaustive)
+{
+    const char *names[] = {"mean", "threshold", "box_blur"};
+    const int sizes[] = {3, 7, 31};
+    int nfailed = 0;
+    struct image *ref = image_alloc_maxval(img->height, img->width, img->maxval);
+    struct image *out = image_alloc_maxval(img->height, img->width, img->maxval);
+    size_t nbytes = (size_t)img->height * image_row_bytes(img);
+    int saved_threads = image_threads;
+
+    for (int n = 0; n < 3; ++n)
+    {
+        struct filter *filter = filter_find(names[n]);
+        for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); ++s)
+        {
+            int size = sizes[s];
+            int radius = size / 2;
+            image_threads = 1;
+            filter->rank(img, size, ref, 0, img->height);
+
+            int mismatch = -1;
+            for (int p = 0; exhaustive && p < img->height * img->width && mismatch < 0; ++p)
+            {
+                int row = p / img->width;
+                int col = p % img->width;
+                uint64_t sum = 0;
+                uint64_t sqsum = 0;
+                int count = 0;
+                for (int r = MAX(row - radius, 0); r <= MIN(row + radius, img->height - 1); ++r)
+                    for (int c = MAX(col - radius, 0); c <= MIN(col + radius, img->width - 1); ++c)
+                    {
+                        uint64_t v = pixel_get(img, (size_t)r * img->width + c);
+                        sum += v;
+                        sqsum += v * v;
+                        ++count;
+                    }
+                int expected = n == 0   ? (int)(sum / count)
+                               : n == 1 ? local_threshold(pixel_get(img, p), sum, sqsum, count, img->maxval)
+                                        : (int)(sum / (size * size));
+                if (pixel_get(ref, p) != expected)
+                    mismatch = p;
+            }
+            if (mismatch >= 0)
+            {
+                fprintf(stderr, "%s %s:%d : mismatch at row %d, col %d\n", label, names[n], size,
+                        mismatch / img->width, mismatch % img->width);
+                ++nfailed;
+            }
+
+            image_threads = 3;
+            filter->rank(img, size, out, 0, img->height);
+            if (memcmp(ref->raster[0], out->raster[0], nbytes) != 0)
+            {
+                fprintf(stderr, "%s %s:%d : the threaded table differs\n", label, names[n], size);
+                ++nfailed;
+            }
+        }
+    }
+
+    image_threads = saved_threads;
+    image_free(ref);
+    image_free(out);
+    return nfailed;
+}
+
+/* Histograms counted by one thread and by several are checked against a plain count */
+int check_histogram(struct image *img, const char *label)
+{
+    size_t nbins = (size_t)img->maxval + 1;
+    uint64_t *ref = (uint64_t *)calloc(nbins, sizeof(uint64_t));
+    uint64_t *hist = (uint64_t *)malloc(sizeof(uint64_t) * nbins);
+    int nfailed = 0;
+    int saved_threads = image_threads;
+
+    for (size_t p = 0; p < (size_t)img->height * img->width; ++p)
+        ++ref[pixel_get(img, p)];
+
+    const int nthreads[] = {1, 3};
+    for (int t = 0; t < 2; ++t)
+    {
+        image_threads = nthreads[t];
+        if (histogram(img, hist) != 0 || memcmp(ref, hist, sizeof(uint64_t) * nbins) != 0)
+        {
+            fprintf(stderr, "%s histogram (%d threads) : the counts differ\n", label, nthreads[t]);
+            ++nfailed;
+        }
+    }
+
+    image_threads = saved_threads;
+    free(ref);
+    free(hist);
+    return nfailed;
+}
+
+/* The vectorized RGB rows are checked against the scalar ones, and a round trip must give back the pixels */
+int check_colour(const char *label)
+{
+    const int widths[] = {1, 15, 16, 17, 100};
+    int nfailed = 0;
+
+    for (int w = 0; w < (int)(sizeof(widths) / sizeof(widths[0])); ++w)
+    {
+        int width = widths[w];
+        struct image *planes[3];
+        struct image *ref[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            planes[c] = image_alloc(1, width);
+            ref[c] = image_alloc(1, width);
+        }
+        unsigned char *pixels = (unsigned char *)malloc(3 * width);
+        unsigned char *back = (unsigned char *)malloc(3 * width);
+        for (int i = 0; i < 3 * width; ++i)
+            pixels[i] = rand() % 256;
+
+        rgb_convert_row(pixels, ref, 0, 0, NULL);
+        rgb_convert_row(pixels, planes, 0, 0, rgb_row_select(255, 0));
+        rgb_convert_row(back, planes, 0, 1, rgb_row_select(255, 1));
+
+        int mismatch = memcmp(pixels, back, 3 * width) != 0;
+        for (int c = 0; c < 3; ++c)
+            mismatch |= memcmp(planes[c]->raster[0], ref[c]->raster[0], width) != 0;
+        if (mismatch)
+        {
+            fprintf(stderr, "%s rgb %d pixels : the planes or the round trip differ\n", label, width);
+            ++nfailed;
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            image_free(planes[c]);
+            image_free(ref[c]);
+        }
+        free(pixels);
+        free(back);
+    }
+    return nfailed;
+}
+
+/*
+ * Larger gaussian blurs are checked against a plain 2D sum over v[k] * h[l].
+ * Up to 15x15, the binomial coefficients keep every sum exact.
+ */
+int check_separable(struct image *img, const char *label)
+{
+    const int sizes[] = {5, 7, 15};
+    int nfailed = 0;
+    struct image *out = image_alloc(img->height, img->width);
+
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); ++i)
+    {
+        struct separable_kernel sep;
+        gaussian_blur_separable(&sep, sizes[i]);
+        convolve_separable(img, &sep, out);
+
+        int radius = sep.size / 2;
+        int mismatch = -1;
+        for (int row = 0; row < img->height && mismatch < 0; ++row)
+        {
+            for (int col = 0; col < img->width && mismatch < 0; ++col)
+            {
+                double sum = 0;
+                for (int k = 0; k < sep.size; ++k)
+                    for (int l = 0; l < sep.size; ++l)
+                    {
+                        int r = row + k - radius;
+                        int c = col + l - radius;
+                        if (r >= 0 && r < img->height && c >= 0 && c < img->width)
+                            sum += sep.v[k] * sep.h[l] * img->raster[r][c];
+                    }
+                if (clamp_pixel_8(sum, 255) != out->raster[row][col])
+                    mismatch = row * img->width + col;
+            }
+        }
+
+        if (mismatch >= 0)
+        {
+            fprintf(stderr, "%s gaussian_blur:%d : mismatch at row %d, col %d\n",
+                    label, sep.size, mismatch / img->width, mismatch % img->width);
+            ++nfailed;
+        }
+    }
+
+    image_free(out);
+    return nfailed;
+}
+
+/* Fused chains are checked against their stages applied one after the other on whole images */
+int check_chain(struct image *img, const char *label)
+{
+    const char *specs[] = {"gaussian_blur,sharpen,edge_detect", "box_blur:7,sobel,gaussian_blur:5,identity",
+                           "median,erode:5,sharpen,median:7,dilate", "mean:9,sharpen,threshold:15",
+                           "gaussian_blur:5,equalize,sharpen,autolevels,median"};
+    int nfailed = 0;
+    struct image *ref = image_alloc_maxval(img->height, img->width, img->maxval);
+    struct image *tmp = image_alloc_maxval(img->height, img->width, img->maxval);
+    struct image *out = image_alloc_maxval(img->height, img->width, img->maxval);
+    size_t nbytes = (size_t)img->height * image_row_bytes(img);
+
+    for (int i = 0; i < (int)(sizeof(specs) / sizeof(specs[0])); ++i)
+    {
+        struct chain chain;
+        chain_parse(&chain, specs[i]);
+
+        memcpy(ref->raster[0], img->raster[0], nbytes);
+        for (int k = 0; k < chain.nstages; ++k)
+        {
+            struct image *swap = tmp;
+            tmp = ref;
+            ref = swap;
+            stage_band(&chain.stages[k], tmp, ref, 0, img->height);
+        }
+
+        chain_run(&chain, img, out);
+        if (memcmp(ref->raster[0], out->raster[0], nbytes) != 0)
+        {
+            fprintf(stderr, "%s %s : the fused chain differs from its stages\n", label, specs[i]);
+            ++nfailed;
+        }
+    }
+
+    image_free(ref);
+    image_free(tmp);
+    image_free(out);
+    return nfailed;
+}
+
+/* Every vectorized path supported by the CPU is checked, down to the scalar one */
+int check(struct image *img)
+{
+    /* Small and odd sizes exercise the border strips and partial tiles */
+    const int sizes[][2] = {{1, 1}, {1, 7}, {7, 1}, {2, 2}, {3, 3}, {5, 17}, {3, 50}, {67, TILE_WIDTH + 5}};
+    /* 8-bit, full 16-bit and 12-bit images */
+    const int maxvals[] = {255, 65535, 4095};
+    int nfailed = 0;
+    int max_level = simd_level >= 0 ? simd_level : simd_supported();
+
+    for (int level = max_level; level >= SIMD_NONE; --level)
+    {
+        simd_level = level;
+        int nfailed_level = 0;
+
+        srand(0);
+        for (int m = 0; m < (int)(sizeof(maxvals) / sizeof(maxvals[0])); ++m)
+        {
+            for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); ++i)
+            {
+                struct image *synthetic = image_alloc_maxval(sizes[i][0], sizes[i][1], maxvals[m]);
+                for (int p = 0; p < synthetic->height * synthetic->width; ++p)
+                    pixel_set(synthetic, p, rand() % (maxvals[m] + 1));
+
+                char label[64];
+                snprintf(label, sizeof(label), "[%s] %dx%d/%d", simd_names[level],
+                         synthetic->height, synthetic->width, maxvals[m]);
+                nfailed_level += check_image(synthetic, label);
+                if (level == SIMD_NONE && maxvals[m] == 255)
+                    nfailed_level += check_separable(synthetic, label);
+                nfailed_level += check_chain(synthetic, label);
+                nfailed_level += check_norms(synthetic, label);
+                if (synthetic->height * synthetic->width <= 4096) /* the reference sorts every window */
+                    nfailed_level += check_rank(synthetic, label);
+                nfailed_level += check_integral(synthetic, label, synthetic->height * synthetic->width <= 4096);
+                nfailed_level += check_histogram(synthetic, label);
+                if (i == (int)(sizeof(sizes) / sizeof(sizes[0])) - 1)
+                    nfailed_level += check_quantized(synthetic, label);
+                image_free(synthetic);
+            }
+        }
+
+        char colour_label[64];
+        snprintf(colour_label, sizeof(colour_label), "[%s]", simd_names[level]);
+        nfailed_level += check_colour(colour_label);
+        if (level == SIMD_NONE)
+            nfailed_level += check_rank_cost(colour_label);
+
+        if (img != NULL)
+        {
+            char label[64];
+            snprintf(label, sizeof(label), "[%s] input", simd_names[level]);
+            nfailed_level += check_image(img, label);
+            nfailed_level += check_quantized(img, label);
+        }
+
+        printf("%s : %d filter(s), %s\n", simd_names[level], NFILTERS,
+               nfailed_level ? "FAILED" : "all outputs identical");
+        nfailed += nfailed_level;
+    }
+
+    return nfailed;
+}
+
+void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-s none|sse2|avx2] [-q] [-H] [-g l2|fast|l1|linf] [-f chain | -F chain_file] "
+                    "[-j nthreads] [-o orientation] filename1 filename2\n",
+            progname);
+    fprintf(stderr, "       %s [-s none|sse2|avx2] [-q] [-H] [-g l2|fast|l1|linf] [-f chain | -F chain_file] "
+                    "[-j nthreads] -S|-a filename1|- filename2|-\n",
+            progname);
+    fprintf(stderr, "       %s [-s none|sse2|avx2] [-q] [-H] [-g l2|fast|l1|linf] [-f chain | -F chain_file] "
+                    "[-j nworkers] -b directory|manifest output_directory\n",
+            progname);
+    fprintf(stderr, "       %s [-s none|sse2|avx2] -c [filename1]\n", progname);
+    fprintf(stderr, "Filters :");
+    for (int i = 0; i < NFILTERS; ++i)
+        fprintf(stderr, " %s", filters[i].name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "gaussian_blur accepts an odd size up to %d (e.g. gaussian_blur:15), "
+                    "box_blur, median, erode, dilate, mean and threshold up to %d\n",
+            SEPARABLE_MAX_SIZE, WINDOW_MAX_SIZE);
+    fprintf(stderr, "mean is the local mean and threshold the local (Sauvola) binarization over "
+                    "a window of any size, from a summed-area table like box_blur above 3\n");
+    fprintf(stderr, "equalize and autolevels stretch the levels from the histogram of their whole input "
+                    "(they cannot be streamed)\n");
+    fprintf(stderr, "Colour (P6) images are filtered plane by plane, or turned into a grey image "
+                    "when the chain starts with grey (e.g. grey,sharpen)\n");
+    fprintf(stderr, "A chain is a list of filters separated by commas (e.g. gaussian_blur:5,sharpen,sobel)\n");
+    fprintf(stderr, "-S streams the image through a window of rows; - is the standard input or output\n");
+    fprintf(stderr, "-a streams it too, reading the next band and writing the previous one with asynchronous "
+                    "I/O while a band is filtered (regular files)\n");
+    fprintf(stderr, "-g sets the gradient norm of sobel : l2 (default), fast (within one of l2), l1 or linf\n");
+    fprintf(stderr, "-o also writes the gradient orientation of a single sobel stage, in %d bins "
+                    "(0 : horizontal, 1 and 3 : diagonals, 2 : vertical)\n",
+            ORIENTATION_NBINS);
+    fprintf(stderr, "-b filters the .pgm files of a directory, or the files listed in a manifest, "
+                    "into output_directory with nworkers threads (default : get_nprocs())\n");
+    fprintf(stderr, "-j also sets the number of threads that build the summed-area tables and the histograms "
+                    "of a single image\n");
+    fprintf(stderr, "-H maps the large rasters on explicit huge pages when the system has reserved some\n");
+    fprintf(stderr, "-q rounds the 3x3 kernels to fixed point (integer arithmetic, may differ by the rounding)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct chain chain;
+    chain_parse(&chain, "edge_detect2");
+    int check_mode = 0;
+    int stream_mode = 0;
+    int async_mode = 0;
+    int batch_mode = 0;
+    int nworkers = get_nprocs();
+    const char *orientation = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "abcf:F:g:Hj:o:qs:S")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            check_mode = 1;
+            break;
+        case 'f':
+            if (chain_parse(&chain, optarg) != 0)
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            if (chain_load(&chain, optarg) != 0)
+                return EXIT_FAILURE;
+            break;
+        case 'S':
+            stream_mode = 1;
+            break;
+        case 'a':
+            async_mode = 1;
+            break;
+        case 'q':
+            quantize = 1;
+            break;
+        case 'b':
+            batch_mode = 1;
+            break;
+        case 'H':
+            raster_hugetlb = 1;
+            break;
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1)
+            {
+                fprintf(stderr, "Invalid number of workers : %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'g':
+            gradient_norm = -1;
+            for (int norm = NORM_L2; norm <= NORM_LINF; ++norm)
+                if (strcmp(norm_names[norm], optarg) == 0)
+                    gradient_norm = norm;
+            if (gradient_norm < 0)
+            {
+                fprintf(stderr, "Unknown gradient norm : %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            orientation = optarg;
+            break;
+        case 's':
+            simd_level = -1;
+            for (int level = SIMD_NONE; level <= SIMD_AVX2; ++level)
+                if (strcmp(simd_names[level], optarg) == 0)
+                    simd_level = level;
+            if (simd_level < 0)
+            {
+                fprintf(stderr, "Unknown vectorized path : %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (check_mode)
+    {
+        struct image *img = NULL;
+        if (optind < argc)
+        {
+            FILE *fp = fopen(argv[optind], "r");
+            if (fp == NULL)
+            {
+                fprintf(stderr, "Unable to open input file : %s\n", argv[optind]);
+                return EXIT_FAILURE;
+            }
+            img = pgm_parse(fp);
+            fclose(fp);
+            if (img == NULL)
+                return EXIT_FAILURE;
+        }
+        int nfailed = check(img);
+        if (img != NULL)
+            image_free(img);
+        return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (argc - optind != 2)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (batch_mode)
+    {
+        char **inputs, **outputs;
+        int nfiles = batch_list(argv[optind], argv[optind + 1], &inputs, &outputs);
+        if (nfiles < 0)
+            return EXIT_FAILURE;
+
+        int nfailed = batch_run(&chain, inputs, outputs, nfiles, nworkers);
+        if (nfailed > 0)
+            fprintf(stderr, "%d of %d file(s) failed\n", nfailed, nfiles);
+
+        for (int i = 0; i < nfiles; ++i)
+        {
+            free(inputs[i]);
+            free(outputs[i]);
+        }
+        free(inputs);
+        free(outputs);
+        return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    image_threads = MIN(nworkers, IMAGE_MAX_THREADS);
+
+    if (orientation != NULL && (stream_mode || async_mode || chain.nstages != 1 || chain.stages[0].size != 3 ||
+                                chain.stages[0].filter->kernels[1] == NULL))
+    {
+        fprintf(stderr, "The orientation needs a single gradient filter (e.g. sobel) on a whole image\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Between regular files, -a overlaps the reads and writes with the chain; pipes go through stdio */
+    if (async_mode && strcmp(argv[optind], "-") != 0 && strcmp(argv[optind + 1], "-") != 0)
+    {
+        int status = chain_stream_async(&chain, argv[optind], argv[optind + 1]);
+        if (status != 0)
+            return status > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (stream_mode || async_mode)
+    {
+        int use_stdin = strcmp(argv[optind], "-") == 0;
+        int use_stdout = strcmp(argv[optind + 1], "-") == 0;
+        if (!use_stdin && !use_stdout && same_file(argv[optind], argv[optind + 1]))
+        {
+            fprintf(stderr, "The output is the input file : %s\n", argv[optind + 1]);
+            return EXIT_FAILURE;
+        }
+
+        FILE *in = use_stdin ? stdin : fopen(argv[optind], "r");
+        if (in == NULL)
+        {
+            fprintf(stderr, "Unable to open input file : %s\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+        FILE *out = use_stdout ? stdout : fopen(argv[optind + 1], "w");
+        if (out == NULL)
+        {
+            fprintf(stderr, "Unable to open output file : %s\n", argv[optind + 1]);
+            return EXIT_FAILURE;
+        }
+
+        int status = chain_stream(&chain, in, out);
+
+        if (!use_stdin)
+            fclose(in);
+        if (!use_stdout)
+            fclose(out);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (ppm_is_colour(argv[optind]))
+    {
+        if (orientation != NULL)
+        {
+            fprintf(stderr, "The orientation needs a grey image\n");
+            return EXIT_FAILURE;
+        }
+        return colour_run(&chain, argv[optind], argv[optind + 1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* pgm_create() would truncate the mapped input before it is read */
+    if (same_file(argv[optind], argv[optind + 1]))
+    {
+        fprintf(stderr, "The output is the input file : %s\n", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+
+    /* Files are mapped when possible, otherwise they go through stdio */
+    struct image *img = pgm_map(argv[optind]);
+    if (img == NULL && errno == EINVAL)
+        return EXIT_FAILURE;
+    if (img == NULL)
+    {
+        FILE *fp = fopen(argv[optind], "r");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open input file : %s\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+
+        img = pgm_parse(fp);
+        fclose(fp);
+        if (img == NULL)
+            return EXIT_FAILURE;
+    }
+
+    /* Only 8-bit outputs are mapped, 16-bit ones are swapped to big-endian when written */
+    struct image *out = NULL;
+    if (img->maxval <= 255)
+        out = pgm_create(argv[optind + 1], img->height, img->width);
+    int mapped_output = out != NULL;
+    if (out == NULL)
+        out = image_alloc_maxval(img->height, img->width, img->maxval);
+    if (out == NULL)
+    {
+        fprintf(stderr, "Unable to allocate image struct\n");
+        return EXIT_FAILURE;
+    }
+
+    /* A single stage goes over the whole image, longer chains are fused */
+    if (chain.nstages == 1)
+        stage_band(&chain.stages[0], img, out, 0, img->height);
+    else if (chain_run(&chain, img, out) != 0)
+        return EXIT_FAILURE;
+
+    if (!mapped_output)
+    {
+        FILE *fp = fopen(argv[optind + 1], "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open output file : %s\n", argv[optind + 1]);
+            return EXIT_FAILURE;
+        }
+
+        pgm_write_header(out, fp);
+        pgm_write_raster(out, fp);
+        fclose(fp);
+    }
+
+    if (orientation != NULL)
+    {
+        struct image *orient = image_alloc_maxval(img->height, img->width, ORIENTATION_NBINS - 1);
+        FILE *fp = fopen(orientation, "w");
+        if (orient == NULL || fp == NULL)
+        {
+            fprintf(stderr, "Unable to write the orientation : %s\n", orientation);
+            return EXIT_FAILURE;
+        }
+
+        gradient_orientation(img, chain.stages[0].filter->kernels, orient);
+        pgm_write_header(orient, fp);
+        pgm_write_raster(orient, fp);
+        fclose(fp);
+        image_free(orient);
+    }
 
     image_free(img);
     image_free(out);